@@ -0,0 +1,448 @@
+/**
+ * @file 		ModbusHal.h
+ * @version     1.20
+ *
+ * @description
+ *  Hardware abstraction used by ModbusRtu.h: time source, serial transport,
+ *  RS-485 direction control and TX complete detection.
+ *
+ *  The Arduino backend is used whenever ARDUINO is defined, so sketches
+ *  build as before. Otherwise the POSIX backend drives a tty through
+ *  termios, takes the time from CLOCK_MONOTONIC and uses the RTS line
+ *  of the port as RS-485 driver enable.
+ *
+ * @license
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; version
+ *  2.1 of the License.
+ *
+ * @defgroup hal Modbus Hardware Abstraction
+ */
+
+#ifndef MODBUSHAL_H
+#define MODBUSHAL_H
+
+#include <inttypes.h>
+
+#if defined(ARDUINO)
+
+#include "Arduino.h"
+#include "Print.h"
+
+/**
+ * @brief
+ * Serial transport: the Arduino HardwareSerial ports
+ * @ingroup hal
+ */
+typedef HardwareSerial ModbusPort;
+
+/**
+ * @brief
+ * Milliseconds since start-up, for the master time-out
+ * @ingroup hal
+ */
+static inline uint32_t halMillis() {
+  return millis();
+}
+
+/**
+ * @brief
+ * Microseconds since start-up, for the T1.5 and T3.5 silent intervals
+ * @ingroup hal
+ */
+static inline uint32_t halMicros() {
+  return micros();
+}
+
+/**
+ * @brief
+ * Serial port number u8serno: 0-Serial, 1..3-Serial1..Serial3
+ * @ingroup hal
+ */
+static inline ModbusPort *halPort( uint8_t u8serno ) {
+  switch( u8serno ) {
+#if defined(UBRR1H)
+  case 1:
+    return &Serial1;
+#endif
+
+#if defined(UBRR2H)
+  case 2:
+    return &Serial2;
+#endif
+
+#if defined(UBRR3H)
+  case 3:
+    return &Serial3;
+#endif
+  case 0:
+  default:
+    return &Serial;
+  }
+}
+
+/**
+ * @brief
+ * Sets up the RS-485 driver enable pin in receive mode
+ * @ingroup hal
+ */
+static inline void halPinSetup( ModbusPort *port, uint8_t u8pin ) {
+  pinMode( u8pin, OUTPUT );
+  digitalWrite( u8pin, LOW );
+}
+
+/**
+ * @brief
+ * Drives the RS-485 driver enable pin, HIGH to transmit
+ * @ingroup hal
+ */
+static inline void halPinWrite( ModbusPort *port, uint8_t u8pin, uint8_t u8level ) {
+  digitalWrite( u8pin, u8level );
+}
+
+/**
+ * @brief
+ * Clears the TX complete flag of the USART before a frame is sent
+ * @ingroup hal
+ */
+static inline void halTxStart( uint8_t u8serno ) {
+  switch( u8serno ) {
+#if defined(UBRR1H)
+  case 1:
+    UCSR1A=UCSR1A |(1 << TXC1);
+    break;
+#endif
+
+#if defined(UBRR2H)
+  case 2:
+    UCSR2A=UCSR2A |(1 << TXC2);
+    break;
+#endif
+
+#if defined(UBRR3H)
+  case 3:
+    UCSR3A=UCSR3A |(1 << TXC3);
+    break;
+#endif
+  case 0:
+  default:
+    UCSR0A=UCSR0A |(1 << TXC0);
+    break;
+  }
+}
+
+/**
+ * @brief
+ * Waits until the last stop bit has left the USART
+ * @ingroup hal
+ */
+static inline void halTxWait( ModbusPort *port, uint8_t u8serno ) {
+  switch( u8serno ) {
+#if defined(UBRR1H)
+  case 1:
+    while (!(UCSR1A & (1 << TXC1)));
+    break;
+#endif
+
+#if defined(UBRR2H)
+  case 2:
+    while (!(UCSR2A & (1 << TXC2)));
+    break;
+#endif
+
+#if defined(UBRR3H)
+  case 3:
+    while (!(UCSR3A & (1 << TXC3)));
+    break;
+#endif
+  case 0:
+  default:
+    while (!(UCSR0A & (1 << TXC0)));
+    break;
+  }
+}
+
+/**
+ * @brief
+ * Enables (bEnable = true) or disables the USART TX complete interrupt
+ * @ingroup hal
+ */
+static inline void halTxInterrupt( uint8_t u8serno, boolean bEnable ) {
+  switch( u8serno ) {
+#if defined(UBRR1H)
+  case 1:
+    if (bEnable) UCSR1B |= (1 << TXCIE1);
+    else UCSR1B &= ~(1 << TXCIE1);
+    break;
+#endif
+
+#if defined(UBRR2H)
+  case 2:
+    if (bEnable) UCSR2B |= (1 << TXCIE2);
+    else UCSR2B &= ~(1 << TXCIE2);
+    break;
+#endif
+
+#if defined(UBRR3H)
+  case 3:
+    if (bEnable) UCSR3B |= (1 << TXCIE3);
+    else UCSR3B &= ~(1 << TXCIE3);
+    break;
+#endif
+  case 0:
+  default:
+    if (bEnable) UCSR0B |= (1 << TXCIE0);
+    else UCSR0B &= ~(1 << TXCIE0);
+    break;
+  }
+}
+
+/**
+ * @brief
+ * TRUE while the serial driver still holds bytes to send.
+ * A late refill of the data register can let TXC fire between bytes.
+ * @ingroup hal
+ */
+static inline boolean halTxPending( ModbusPort *port ) {
+#if defined(SERIAL_TX_BUFFER_SIZE)
+  return (port->availableForWrite() < SERIAL_TX_BUFFER_SIZE - 1);
+#else
+  return false;
+#endif
+}
+
+/**
+ * @brief
+ * Disables interrupts and returns the previous state for halUnlock()
+ * @ingroup hal
+ */
+static inline uint8_t halLock() {
+#if defined(__AVR__)
+  uint8_t u8sreg = SREG;
+  cli();
+  return u8sreg;
+#else
+  noInterrupts();
+  return 0;
+#endif
+}
+
+/**
+ * @brief
+ * Restores the interrupt state saved by halLock()
+ * @ingroup hal
+ */
+static inline void halUnlock( uint8_t u8sreg ) {
+#if defined(__AVR__)
+  SREG = u8sreg;
+#else
+  interrupts();
+#endif
+}
+
+#else // POSIX
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+/* Arduino helpers used by the protocol engine */
+typedef bool boolean;
+#define HIGH 0x1
+#define LOW  0x0
+#define PROGMEM
+#define pgm_read_byte(addr) (*(const uint8_t *)(addr))
+#define pgm_read_word(addr) (*(const uint16_t *)(addr))
+#define lowByte(w) ((uint8_t) ((w) & 0xff))
+#define highByte(w) ((uint8_t) ((w) >> 8))
+#define bitRead(value, bit) (((value) >> (bit)) & 0x01)
+#define bitSet(value, bit) ((value) |= (1UL << (bit)))
+#define bitClear(value, bit) ((value) &= ~(1UL << (bit)))
+#define bitWrite(value, bit, bitvalue) ((bitvalue) ? bitSet(value, bit) : bitClear(value, bit))
+
+static inline uint16_t word( uint8_t h, uint8_t l ) {
+  return (h << 8) | l;
+}
+
+// there is no TX complete interrupt, txEnd() waits for tcdrain()
+#ifndef MODBUS_NO_TX_ISR
+#define MODBUS_NO_TX_ISR
+#endif
+
+/**
+ * @class ModbusPort
+ * @brief
+ * Serial transport over a POSIX tty, raw 8N1.
+ * Its methods follow HardwareSerial, so the engine does not change.
+ * @ingroup hal
+ */
+class ModbusPort {
+private:
+  const char *pcDevice; //!< tty path, e.g. "/dev/ttyUSB0"
+  int fd; //!< open tty, -1 if closed
+
+  static speed_t baudConst( long u32speed ) {
+    switch( u32speed ) {
+    case 1200: return B1200;
+    case 2400: return B2400;
+    case 4800: return B4800;
+    case 9600: return B9600;
+    case 19200: return B19200;
+    case 38400: return B38400;
+    case 57600: return B57600;
+    case 115200: return B115200;
+    case 230400: return B230400;
+#ifdef B460800
+    case 460800: return B460800;
+#endif
+#ifdef B921600
+    case 921600: return B921600;
+#endif
+    default: return B0;
+    }
+  }
+
+public:
+  ModbusPort() : pcDevice( NULL ), fd( -1 ) {}
+
+  void setDevice( const char *pcDevice ) { this->pcDevice = pcDevice; }
+
+  int getFd() { return fd; }
+
+  /**
+   * Opens the tty. It stays closed, getFd() < 0, if it cannot be opened
+   * or u32speed is not a termios rate: the engine computes T1.5 and T3.5
+   * from u32speed, another line rate would break the framing.
+   */
+  void begin( long u32speed ) {
+    struct termios tio;
+
+    end();
+    if ((pcDevice == NULL) || (baudConst( u32speed ) == B0)) return;
+    fd = open( pcDevice, O_RDWR | O_NOCTTY | O_NONBLOCK );
+    if (fd < 0) return;
+
+    tcgetattr( fd, &tio );
+    cfmakeraw( &tio );
+    tio.c_cflag |= CLOCAL | CREAD;
+    tio.c_cflag &= ~(CSTOPB | PARENB | CRTSCTS);
+    cfsetispeed( &tio, baudConst( u32speed ) );
+    cfsetospeed( &tio, baudConst( u32speed ) );
+    tcsetattr( fd, TCSANOW, &tio );
+    tcflush( fd, TCIOFLUSH );
+  }
+
+  void end() {
+    if (fd >= 0) close( fd );
+    fd = -1;
+  }
+
+  int available() {
+    int i16count = 0;
+    if ((fd < 0) || (ioctl( fd, FIONREAD, &i16count ) < 0)) return 0;
+    return i16count;
+  }
+
+  int read() {
+    uint8_t u8byte;
+    if ((fd < 0) || (::read( fd, &u8byte, 1 ) != 1)) return -1;
+    return u8byte;
+  }
+
+  size_t write( const uint8_t *pu8data, size_t u16length ) {
+    size_t u16sent = 0;
+    if (fd < 0) return 0;
+
+    while (u16sent < u16length) {
+      ssize_t i16done = ::write( fd, pu8data + u16sent, u16length - u16sent );
+      if (i16done > 0) {
+        u16sent += i16done;
+      }
+      else if ((i16done < 0) && (errno != EAGAIN) && (errno != EINTR)) {
+        // EIO of an unplugged adapter or a hung up pty
+        break;
+      }
+      else {
+        // the kernel buffer is full, wait for room
+        struct pollfd pfd = { fd, POLLOUT, 0 };
+        if (poll( &pfd, 1, 100 ) < 0) break;
+        if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) break;
+      }
+    }
+    return u16sent;
+  }
+
+  void flush() {
+    if (fd >= 0) tcdrain( fd );
+  }
+
+  void setRts( uint8_t u8level ) {
+    int i16bits = TIOCM_RTS;
+    if (fd >= 0) ioctl( fd, u8level ? TIOCMBIS : TIOCMBIC, &i16bits );
+  }
+};
+
+static inline uint32_t halMillis() {
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return (uint32_t)ts.tv_sec * 1000UL + ts.tv_nsec / 1000000L;
+}
+
+static inline uint32_t halMicros() {
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return (uint32_t)ts.tv_sec * 1000000UL + ts.tv_nsec / 1000L;
+}
+
+/**
+ * @brief
+ * Serial port number u8serno 0..3, one per process.
+ * Name its tty with halSetDevice() before Modbus::begin().
+ * @ingroup hal
+ */
+inline ModbusPort *halPort( uint8_t u8serno ) {
+  static ModbusPort aPorts[ 4 ];
+  return &aPorts[ u8serno & 3 ];
+}
+
+inline void halSetDevice( uint8_t u8serno, const char *pcDevice ) {
+  halPort( u8serno )->setDevice( pcDevice );
+}
+
+// the RTS line of the port is the RS-485 driver enable, u8pin only selects it
+static inline void halPinSetup( ModbusPort *port, uint8_t ) {
+  port->setRts( LOW );
+}
+
+static inline void halPinWrite( ModbusPort *port, uint8_t, uint8_t u8level ) {
+  port->setRts( u8level );
+}
+
+static inline void halTxStart( uint8_t ) {}
+
+static inline void halTxWait( ModbusPort *port, uint8_t ) {
+  port->flush();
+}
+
+static inline void halTxInterrupt( uint8_t, boolean ) {}
+
+static inline boolean halTxPending( ModbusPort * ) {
+  return false;
+}
+
+// the engine runs in one thread, there is nothing to mask
+static inline uint8_t halLock() {
+  return 0;
+}
+
+static inline void halUnlock( uint8_t ) {}
+
+#endif
+
+#endif // MODBUSHAL_H
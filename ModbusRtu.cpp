@@ -0,0 +1,14 @@
+/**
+ * @file 		ModbusRtu.cpp
+ *
+ * @description
+ *  Compiles the Modbus RTU engine once for native builds (see CMakeLists.txt),
+ *  with the POSIX backend of ModbusHal.h.
+ *  Arduino sketches compile it by including ModbusRtu.h, so this file
+ *  is empty there.
+ */
+
+#if !defined(ARDUINO)
+#define MODBUS_IMPLEMENTATION
+#include "ModbusRtu.h"
+#endif
@@ -37,9 +37,11 @@
  *
  */
 
+#ifndef MODBUSRTU_H
+#define MODBUSRTU_H
+
 #include <inttypes.h>
-#include "Arduino.h"	
-#include "Print.h"
+#include "ModbusHal.h"
 
 /**
  * @struct modbus_t 
@@ -58,10 +60,194 @@ typedef struct {
 } 
 modbus_t;
 
+/**
+ * @struct modbus_frame_t
+ * @brief
+ * Captured RTU frame for offline CRC verification with crc16CheckFrames()
+ */
+typedef struct {
+  const uint8_t *pu8data; /*!< First byte of the frame (slave id) */
+  uint16_t u16length;     /*!< Frame length including both CRC bytes */
+}
+modbus_frame_t;
+
+/**
+ * @struct modbus_segment_t
+ * @brief
+ * Slave storage for a range of coils, inputs or registers.
+ * A table is an array of segments sorted by address, that do not overlap.
+ * Only the published ranges need memory, anywhere in the 16-bit address space.
+ * The dirty bitmap has one bit per register, or one bit per byte of 8 coils:
+ * (u16length + 7) / 8 bytes for registers, (u16length + 63) / 64 for coils.
+ *
+ * @see Modbus::setSegments()
+ */
+typedef struct {
+  uint16_t u16start;     /*!< Address of the first coil or register */
+  uint16_t u16length;    /*!< Number of coils or registers */
+  const void *pData;     /*!< Coil/input n is bit n%8 of byte n/8, registers are words */
+  uint8_t u8flags;       /*!< SEGMENT_FLAGS */
+  uint8_t *pu8dirty;     /*!< Optional bitmap of the entries written by the master, see takeDirty() */
+}
+modbus_segment_t;
+
+/**
+ * @enum SEGMENT_FLAGS
+ * @brief
+ * Options of a modbus_segment_t
+ */
+enum SEGMENT_FLAGS {
+  SEG_READONLY                 = 1, //!< writes answer EXC_ADDR_RANGE
+  SEG_FLASH                    = 2, //!< pData is in PROGMEM, read-only too
+  SEG_DOUBLE                   = 4  //!< pData holds two images swapped by publish(), read-only too
+};
+
+/**
+ * @enum MB_TABLES
+ * @brief
+ * Slave tables, each one with its own address space
+ */
+enum MB_TABLES {
+  MB_COILS                     = 0, //!< FC1, FC5, FC15
+  MB_DISCRETE_INPUTS           = 1, //!< FC2
+  MB_HOLDING_REGISTERS         = 2, //!< FC3, FC6, FC16
+  MB_INPUT_REGISTERS           = 3, //!< FC4
+  MB_TABLES_NO                 = 4
+};
+
+/**
+ * @struct modbus_hook_t
+ * @brief
+ * Function called by the slave for a range of coils or registers
+ *
+ * @see Modbus::setWriteHooks()
+ */
+typedef struct {
+  uint8_t u8table;       /*!< MB_TABLES */
+  uint16_t u16start;     /*!< Address of the first coil or register */
+  uint16_t u16length;    /*!< Number of coils or registers */
+  void (*callback)( uint8_t u8table, uint16_t u16add, uint16_t u16count ); /*!< Gets the part of the range accessed */
+}
+modbus_hook_t;
+
+/**
+ * @struct modbus_read_hook_t
+ * @brief
+ * Function called by the slave before it answers a read of a range,
+ * to sample the data only when the master asks for it
+ *
+ * @see Modbus::setReadHooks()
+ */
+typedef struct {
+  uint8_t u8table;       /*!< MB_TABLES */
+  uint16_t u16start;     /*!< Address of the first coil, input or register */
+  uint16_t u16length;    /*!< Number of coils, inputs or registers */
+  uint16_t u16maxAge;    /*!< Reads within u16maxAge ms of the last call reuse its sample, 0 to call for every read */
+  void (*callback)( uint8_t u8table, uint16_t u16add, uint16_t u16count ); /*!< Gets the part of the range read */
+  uint32_t u32last;      /*!< Set by the slave: halMillis() of the last call */
+  uint8_t u8sampled;     /*!< Set by the slave: 1 once called, start with 0 */
+}
+modbus_read_hook_t;
+
+/**
+ * @brief
+ * Reads register u16index of a segment
+ */
+static inline uint16_t segmentWord( const modbus_segment_t *segment, uint16_t u16index ) {
+  const uint16_t *pu16data = (const uint16_t *) segment->pData;
+  if (segment->u8flags & SEG_FLASH) return pgm_read_word( &pu16data[ u16index ] );
+  return pu16data[ u16index ];
+}
+
+/**
+ * @brief
+ * First byte of image u8image (0 or 1) of a SEG_DOUBLE segment,
+ * image 1 follows image 0. Other segments only have image 0.
+ */
+static inline uint8_t *segmentImage( const modbus_segment_t *segment, uint8_t u8table, uint8_t u8image ) {
+  uint8_t *pu8data = (uint8_t *) segment->pData;
+  if (!(segment->u8flags & SEG_DOUBLE) || (u8image == 0)) return pu8data;
+  return pu8data + ((u8table <= MB_DISCRETE_INPUTS) ? (segment->u16length + 7) / 8 : segment->u16length * 2);
+}
+
+/**
+ * @brief
+ * Reads up to 8 bits from bit u16bit of a packed bit array,
+ * the first one in bit 0 of the result. Higher bits are left to mask.
+ */
+static inline uint8_t bitPeek( const uint8_t *pu8src, uint16_t u16bit, uint8_t u8count, boolean bFlash ) {
+  const uint8_t *pu8byte = pu8src + (u16bit >> 3);
+  uint8_t u8shift = u16bit & 7;
+  uint16_t u16window = bFlash ? pgm_read_byte( pu8byte ) : *pu8byte;
+
+  // only touch the next byte if the bits go on there
+  if (u8shift + u8count > 8) u16window |= (bFlash ? pgm_read_byte( pu8byte + 1 ) : pu8byte[ 1 ]) << 8;
+  return (uint8_t)(u16window >> u8shift);
+}
+
+/**
+ * @brief
+ * Copies u16count bits between packed bit arrays (bit n is bit n%8 of byte n/8),
+ * a whole destination byte per step. The destination bits outside the range are kept.
+ * Byte aligned copies from RAM are a memcpy().
+ *
+ * @param pu8dst  destination array
+ * @param u16dstBit  first destination bit
+ * @param pu8src  source array
+ * @param u16srcBit  first source bit
+ * @param u16count  number of bits
+ * @param bFlash  TRUE if pu8src is in PROGMEM
+ */
+static inline void bitCopy( uint8_t *pu8dst, uint16_t u16dstBit,
+  const uint8_t *pu8src, uint16_t u16srcBit, uint16_t u16count, boolean bFlash ) {
+  uint8_t u8shift = u16dstBit & 7;
+  uint8_t u8take, u8mask;
+
+  pu8dst += u16dstBit >> 3;
+  if ((u8shift == 0) && ((u16srcBit & 7) == 0) && !bFlash) {
+    memcpy( pu8dst, pu8src + (u16srcBit >> 3), u16count >> 3 );
+    pu8dst += u16count >> 3;
+    u16srcBit += u16count & ~7;
+    u16count &= 7;
+  }
+
+  while (u16count > 0) {
+    // fill the destination byte up to its last bit
+    u8take = 8 - u8shift;
+    if (u8take > u16count) u8take = u16count;
+    u8mask = (uint8_t)(((1 << u8take) - 1) << u8shift);
+    *pu8dst = (*pu8dst & ~u8mask) | ((bitPeek( pu8src, u16srcBit, u8take, bFlash ) << u8shift) & u8mask);
+
+    pu8dst++;
+    u8shift = 0;
+    u16srcBit += u8take;
+    u16count -= u8take;
+  }
+}
+
+/**
+ * @brief
+ * Intersects the range of a hook with the range of a request
+ *
+ * @return TRUE if they overlap, then *pu16first and *pu16count hold the intersection
+ */
+static inline boolean hookRange( uint16_t u16start, uint16_t u16length,
+  uint16_t u16add, uint16_t u16count, uint16_t *pu16first, uint16_t *pu16count ) {
+  uint32_t u32first = (u16add > u16start) ? u16add : u16start;
+  uint32_t u32end = (uint32_t) u16start + u16length;
+
+  if (u32end > (uint32_t) u16add + u16count) u32end = (uint32_t) u16add + u16count;
+  if (u32first >= u32end) return false;
+  *pu16first = u32first;
+  *pu16count = u32end - u32first;
+  return true;
+}
+
 enum { 
   RESPONSE_SIZE = 6, 
   EXCEPTION_SIZE = 3, 
-  CHECKSUM_SIZE = 2
+  CHECKSUM_SIZE = 2,
+  TX_CHUNK = 16 //!< registers encoded per write when streaming an answer
 };
 
 /**
@@ -85,7 +271,7 @@ enum MESSAGE {
  * Modbus function codes summary. 
  * These are the implement function codes either for Master or for Slave.
  *
- * @see also fctsupported
+ * @see also MODBUS_FUNCTIONS
  * @see also modbus_t
  */
 enum MB_FC {
@@ -102,10 +288,24 @@ enum MB_FC {
 
 enum COM_STATES {
   COM_IDLE                     = 0,
-  COM_WAITING                  = 1
+  COM_WAITING                  = 1,
+  COM_SENDING                  = 2  //!< frame queued, RS-485 transceiver still driving the line
 
 };
 
+/**
+ * @enum RX_STATES
+ * @brief
+ * Receive state machine, fed one byte at a time
+ */
+enum RX_STATES {
+  RX_IDLE                      = 0, //!< waiting for the first byte of a frame
+  RX_RECEIVING                 = 1, //!< storing bytes of a frame
+  RX_COMPLETE                  = 2, //!< frame complete, waiting to be processed
+  RX_OVERFLOW                  = 3, //!< frame longer than MAX_BUFFER, dropping bytes until silence
+  RX_DISCARD                   = 4  //!< bad frame, dropping bytes until silence
+};
+
 enum ERR_LIST {
   ERR_NOT_MASTER                = -1,
   ERR_POLLING                   = -2,
@@ -122,19 +322,411 @@ enum {
   EXC_EXECUTE = 4 
 };
 
-const unsigned char fctsupported[] = { 
-  MB_FC_READ_COILS,
-  MB_FC_READ_DISCRETE_INPUT,
-  MB_FC_READ_REGISTERS, 
-  MB_FC_READ_INPUT_REGISTER,
-  MB_FC_WRITE_COIL,
-  MB_FC_WRITE_REGISTER, 
-  MB_FC_WRITE_MULTIPLE_COILS,
-  MB_FC_WRITE_MULTIPLE_REGISTERS
-};
+/**
+ * @brief
+ * Function code masks for MODBUS_FUNCTIONS, bit n stands for function code n.
+ */
+#define MODBUS_FC1    0x00002UL //!< read coils
+#define MODBUS_FC2    0x00004UL //!< read discrete inputs
+#define MODBUS_FC3    0x00008UL //!< read holding registers
+#define MODBUS_FC4    0x00010UL //!< read input registers
+#define MODBUS_FC5    0x00020UL //!< write single coil
+#define MODBUS_FC6    0x00040UL //!< write single register
+#define MODBUS_FC15   0x08000UL //!< write multiple coils
+#define MODBUS_FC16   0x10000UL //!< write multiple registers
+
+/**
+ * @brief
+ * Function codes built into the library, set MODBUS_FUNCTIONS before including
+ * this file, e.g. (MODBUS_FC3 | MODBUS_FC16). The handlers of the others are
+ * not compiled and their requests are answered with EXC_FUNC_CODE.
+ */
+#ifndef MODBUS_FUNCTIONS
+#define MODBUS_FUNCTIONS  (MODBUS_FC1 | MODBUS_FC2 | MODBUS_FC3 | MODBUS_FC4 | \
+  MODBUS_FC5 | MODBUS_FC6 | MODBUS_FC15 | MODBUS_FC16)
+#endif
+
+/**
+ * @brief
+ * Checks in O(1) whether a function code is enabled in MODBUS_FUNCTIONS
+ *
+ * @param u8fct  function code
+ * @return TRUE if supported
+ */
+static inline boolean fctSupported( uint8_t u8fct ) {
+  return (u8fct < 32) && ((MODBUS_FUNCTIONS >> u8fct) & 1);
+}
 
-#define T35  5
+/**
+ * @brief
+ * Size of the frame buffer in bytes, up to the 256 bytes of a full RTU ADU.
+ * With 64 bytes a read is limited to 29 registers, 256 allows the 125 of the spec.
+ */
+#ifndef MAX_BUFFER
 #define  MAX_BUFFER  64	//!< maximum size for the communication buffer in bytes
+#endif
+
+#if (MAX_BUFFER < 8) || (MAX_BUFFER > 256)
+#error "MAX_BUFFER must be between 8 and 256"
+#endif
+
+/**
+ * @brief
+ * Define MODBUS_TX_ISR to have the library own the USART TX complete
+ * interrupts: in RS-485 mode a frame is then queued and poll() returns
+ * while it is sent. The sketch and other libraries must then leave those
+ * vectors alone and not call flush() on the Modbus port, since the
+ * interrupt consumes the TXC flag that HardwareSerial::flush() waits for.
+ * By default the vectors are not defined and the end of a frame is
+ * awaited on the TXC flag.
+ */
+#if !defined(MODBUS_TX_ISR) && !defined(MODBUS_NO_TX_ISR)
+#define MODBUS_NO_TX_ISR
+#endif
+
+/**
+ * @brief
+ * Size of the receive ring filled by Modbus::rxInterrupt(), a power of 2 up to 256.
+ * The ring is for UARTs whose RX interrupt the application owns: a custom
+ * driver, a core with an RX hook, or a host event loop. poll() drains it,
+ * then reads the serial port as without the ring.
+ * On AVR boards the Arduino core owns the USART RX vectors of the
+ * HardwareSerial ports that halPort() links, so the ring stays empty there
+ * and the core buffer remains the limit: raise SERIAL_RX_BUFFER_SIZE in the
+ * build flags to hold a full ADU.
+ * 0 only reads the serial port from poll().
+ */
+#ifndef MODBUS_RX_RING
+#define MODBUS_RX_RING  0
+#endif
+
+/**
+ * @brief
+ * Number of frame buffers shared by all Modbus objects, up to 8.
+ * An object only holds one while it receives, processes or queues a frame,
+ * so several ports can share fewer buffers than objects.
+ * 0 embeds one buffer in each object.
+ */
+#ifndef MODBUS_SHARED_BUFFERS
+#define MODBUS_SHARED_BUFFERS  0
+#endif
+
+#if MODBUS_SHARED_BUFFERS > 8
+#error "MODBUS_SHARED_BUFFERS must be 8 or less"
+#endif
+
+#if (MODBUS_RX_RING > 256) || ((MODBUS_RX_RING & (MODBUS_RX_RING - 1)) != 0)
+#error "MODBUS_RX_RING must be a power of 2 up to 256"
+#endif
+
+/**
+ * @brief
+ * Number of FC3/FC4 answers kept by each slave, resent with their CRC
+ * when the master repeats the same request and no table changed since.
+ * Only requests that read SEG_FLASH or SEG_DOUBLE segments alone are
+ * cached, as those change only through publish() or setSegments().
+ * Plain and SEG_READONLY registers, that the application updates in
+ * place, are always encoded. 0 disables the cache.
+ */
+#ifndef MODBUS_RESPONSE_CACHE
+#define MODBUS_RESPONSE_CACHE  0
+#endif
+
+/**
+ * @brief
+ * Largest answer kept in the response cache, in bytes without the CRC,
+ * up to the 253 of 125 registers. Answers to larger requests are always encoded.
+ */
+#ifndef MODBUS_CACHE_BYTES
+#define MODBUS_CACHE_BYTES  ((MAX_BUFFER < 253) ? MAX_BUFFER : 253)
+#endif
+
+#if (MODBUS_RESPONSE_CACHE > 0) && ((MODBUS_CACHE_BYTES < 5) || (MODBUS_CACHE_BYTES > 253))
+#error "MODBUS_CACHE_BYTES must be between 5 and 253"
+#endif
+
+/**
+ * @brief
+ * Register blocks are swapped to and from big endian with SSE2, SSSE3, AVX2
+ * or NEON when the compiler targets them. SSE2 is part of every x86-64
+ * build, the others need e.g. -mavx2 on a Linux gateway.
+ * Define MODBUS_NO_SIMD to keep the scalar loop.
+ */
+#if !defined(MODBUS_NO_SIMD) && (defined(__SSE2__) || \
+  (defined(__ARM_NEON) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)))
+#define MODBUS_SIMD_SWAP  1
+#if defined(__SSE2__)
+#include <immintrin.h>
+#else
+#include <arm_neon.h>
+#endif
+#else
+#define MODBUS_SIMD_SWAP  0
+#endif
+
+#if MODBUS_SIMD_SWAP
+/**
+ * @brief
+ * Swaps the bytes of u16words little endian words, 16 or 32 bytes per step
+ */
+static inline void swapPairs( uint8_t *pu8dst, const uint8_t *pu8src, uint16_t u16words ) {
+  uint16_t i = 0;
+
+#if defined(__AVX2__)
+  const __m256i mask32 = _mm256_setr_epi8( 1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+    1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14 );
+  for (; i + 16 <= u16words; i += 16) {
+    __m256i v = _mm256_loadu_si256( (const __m256i *)(pu8src + 2 * i) );
+    _mm256_storeu_si256( (__m256i *)(pu8dst + 2 * i), _mm256_shuffle_epi8( v, mask32 ) );
+  }
+#endif
+#if defined(__SSSE3__)
+  const __m128i mask16 = _mm_setr_epi8( 1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14 );
+  for (; i + 8 <= u16words; i += 8) {
+    __m128i v = _mm_loadu_si128( (const __m128i *)(pu8src + 2 * i) );
+    _mm_storeu_si128( (__m128i *)(pu8dst + 2 * i), _mm_shuffle_epi8( v, mask16 ) );
+  }
+#elif defined(__SSE2__)
+  // no byte shuffle before SSSE3: swap with two 16-bit shifts
+  for (; i + 8 <= u16words; i += 8) {
+    __m128i v = _mm_loadu_si128( (const __m128i *)(pu8src + 2 * i) );
+    _mm_storeu_si128( (__m128i *)(pu8dst + 2 * i), _mm_or_si128( _mm_slli_epi16( v, 8 ), _mm_srli_epi16( v, 8 ) ) );
+  }
+#else
+  for (; i + 8 <= u16words; i += 8) {
+    vst1q_u8( pu8dst + 2 * i, vrev16q_u8( vld1q_u8( pu8src + 2 * i ) ) );
+  }
+#endif
+  // at most 7 words are left: the bound keeps the compiler from vectorizing the tail again
+  for (uint8_t j = 0; j < (u16words & 7); j++, i++) {
+    uint8_t u8lo = pu8src[ 2 * i ];
+    pu8dst[ 2 * i ] = pu8src[ 2 * i + 1 ];
+    pu8dst[ 2 * i + 1 ] = u8lo;
+  }
+}
+#endif
+
+/**
+ * @brief
+ * Writes u16count registers to a frame, high byte first
+ */
+static inline void encodeRegisters( uint8_t *pu8dst, const uint16_t *pu16src, uint16_t u16count ) {
+#if MODBUS_SIMD_SWAP
+  swapPairs( pu8dst, (const uint8_t *) pu16src, u16count );
+#else
+  for (uint16_t i = 0; i < u16count; i++) {
+    pu8dst[ 2 * i ] = highByte( pu16src[ i ] );
+    pu8dst[ 2 * i + 1 ] = lowByte( pu16src[ i ] );
+  }
+#endif
+}
+
+/**
+ * @brief
+ * Reads u16count registers from a frame, high byte first
+ */
+static inline void decodeRegisters( uint16_t *pu16dst, const uint8_t *pu8src, uint16_t u16count ) {
+#if MODBUS_SIMD_SWAP
+  swapPairs( (uint8_t *) pu16dst, pu8src, u16count );
+#else
+  for (uint16_t i = 0; i < u16count; i++) {
+    pu16dst[ i ] = word( pu8src[ 2 * i ], pu8src[ 2 * i + 1 ] );
+  }
+#endif
+}
+
+/**
+ * @brief
+ * CRC engine selection, set MODBUS_CRC before including this file.
+ * All variants give identical results, they only trade flash for speed.
+ */
+#define MODBUS_CRC_BITWISE  0 //!< 8 shift/xor steps per byte, no table
+#define MODBUS_CRC_NIBBLE   1 //!< 16-entry table in flash, 2 lookups per byte
+#define MODBUS_CRC_TABLE    2 //!< 256-entry table in flash, 1 lookup per byte
+#define MODBUS_CRC_SLICE8   3 //!< 8 x 256-entry tables in RAM (4 KB), 8 bytes per step (32/64-bit hosts)
+
+// boards keep their RAM, the host build favours speed
+#ifndef MODBUS_CRC
+#if defined(ARDUINO)
+#define MODBUS_CRC  MODBUS_CRC_TABLE
+#else
+#define MODBUS_CRC  MODBUS_CRC_SLICE8
+#endif
+#endif
+
+#if MODBUS_CRC >= MODBUS_CRC_TABLE
+/**
+ * CRC-16/Modbus lookup table (reflected polynomial 0xA001) for one byte
+ */
+const uint16_t au16CRCTable[256] PROGMEM = {
+  0x0000, 0xC0C1, 0xC181, 0x0140, 0xC301, 0x03C0, 0x0280, 0xC241,
+  0xC601, 0x06C0, 0x0780, 0xC741, 0x0500, 0xC5C1, 0xC481, 0x0440,
+  0xCC01, 0x0CC0, 0x0D80, 0xCD41, 0x0F00, 0xCFC1, 0xCE81, 0x0E40,
+  0x0A00, 0xCAC1, 0xCB81, 0x0B40, 0xC901, 0x09C0, 0x0880, 0xC841,
+  0xD801, 0x18C0, 0x1980, 0xD941, 0x1B00, 0xDBC1, 0xDA81, 0x1A40,
+  0x1E00, 0xDEC1, 0xDF81, 0x1F40, 0xDD01, 0x1DC0, 0x1C80, 0xDC41,
+  0x1400, 0xD4C1, 0xD581, 0x1540, 0xD701, 0x17C0, 0x1680, 0xD641,
+  0xD201, 0x12C0, 0x1380, 0xD341, 0x1100, 0xD1C1, 0xD081, 0x1040,
+  0xF001, 0x30C0, 0x3180, 0xF141, 0x3300, 0xF3C1, 0xF281, 0x3240,
+  0x3600, 0xF6C1, 0xF781, 0x3740, 0xF501, 0x35C0, 0x3480, 0xF441,
+  0x3C00, 0xFCC1, 0xFD81, 0x3D40, 0xFF01, 0x3FC0, 0x3E80, 0xFE41,
+  0xFA01, 0x3AC0, 0x3B80, 0xFB41, 0x3900, 0xF9C1, 0xF881, 0x3840,
+  0x2800, 0xE8C1, 0xE981, 0x2940, 0xEB01, 0x2BC0, 0x2A80, 0xEA41,
+  0xEE01, 0x2EC0, 0x2F80, 0xEF41, 0x2D00, 0xEDC1, 0xEC81, 0x2C40,
+  0xE401, 0x24C0, 0x2580, 0xE541, 0x2700, 0xE7C1, 0xE681, 0x2640,
+  0x2200, 0xE2C1, 0xE381, 0x2340, 0xE101, 0x21C0, 0x2080, 0xE041,
+  0xA001, 0x60C0, 0x6180, 0xA141, 0x6300, 0xA3C1, 0xA281, 0x6240,
+  0x6600, 0xA6C1, 0xA781, 0x6740, 0xA501, 0x65C0, 0x6480, 0xA441,
+  0x6C00, 0xACC1, 0xAD81, 0x6D40, 0xAF01, 0x6FC0, 0x6E80, 0xAE41,
+  0xAA01, 0x6AC0, 0x6B80, 0xAB41, 0x6900, 0xA9C1, 0xA881, 0x6840,
+  0x7800, 0xB8C1, 0xB981, 0x7940, 0xBB01, 0x7BC0, 0x7A80, 0xBA41,
+  0xBE01, 0x7EC0, 0x7F80, 0xBF41, 0x7D00, 0xBDC1, 0xBC81, 0x7C40,
+  0xB401, 0x74C0, 0x7580, 0xB541, 0x7700, 0xB7C1, 0xB681, 0x7640,
+  0x7200, 0xB2C1, 0xB381, 0x7340, 0xB101, 0x71C0, 0x7080, 0xB041,
+  0x5000, 0x90C1, 0x9181, 0x5140, 0x9301, 0x53C0, 0x5280, 0x9241,
+  0x9601, 0x56C0, 0x5780, 0x9741, 0x5500, 0x95C1, 0x9481, 0x5440,
+  0x9C01, 0x5CC0, 0x5D80, 0x9D41, 0x5F00, 0x9FC1, 0x9E81, 0x5E40,
+  0x5A00, 0x9AC1, 0x9B81, 0x5B40, 0x9901, 0x59C0, 0x5880, 0x9841,
+  0x8801, 0x48C0, 0x4980, 0x8941, 0x4B00, 0x8BC1, 0x8A81, 0x4A40,
+  0x4E00, 0x8EC1, 0x8F81, 0x4F40, 0x8D01, 0x4DC0, 0x4C80, 0x8C41,
+  0x4400, 0x84C1, 0x8581, 0x4540, 0x8701, 0x47C0, 0x4680, 0x8641,
+  0x8201, 0x42C0, 0x4380, 0x8341, 0x4100, 0x81C1, 0x8081, 0x4040
+};
+#elif MODBUS_CRC == MODBUS_CRC_NIBBLE
+/**
+ * CRC-16/Modbus lookup table (reflected polynomial 0xA001) for one nibble
+ */
+const uint16_t au16CRCTable[16] PROGMEM = {
+  0x0000, 0xCC01, 0xD801, 0x1400, 0xF001, 0x3C00, 0x2800, 0xE401,
+  0xA001, 0x6C00, 0x7800, 0xB401, 0x5000, 0x9C01, 0x8801, 0x4400
+};
+#endif
+
+/**
+ * @brief
+ * Adds one byte to a running CRC-16/Modbus remainder
+ *
+ * @param u16crc  current remainder, 0xFFFF at the start of a frame
+ * @param u8byte  next byte of the frame
+ * @return updated remainder
+ * @ingroup buffer
+ */
+static inline uint16_t crc16Update( uint16_t u16crc, uint8_t u8byte ) {
+#if MODBUS_CRC >= MODBUS_CRC_TABLE
+  return (u16crc >> 8) ^ pgm_read_word( &au16CRCTable[ (uint8_t)(u16crc ^ u8byte) ] );
+#elif MODBUS_CRC == MODBUS_CRC_NIBBLE
+  u16crc ^= u8byte;
+  u16crc = (u16crc >> 4) ^ pgm_read_word( &au16CRCTable[ u16crc & 0x0f ] );
+  return (u16crc >> 4) ^ pgm_read_word( &au16CRCTable[ u16crc & 0x0f ] );
+#else
+  u16crc ^= u8byte;
+  for (uint8_t j = 0; j < 8; j++) {
+    if (u16crc & 0x0001)
+      u16crc = (u16crc >> 1) ^ 0xA001;
+    else
+      u16crc >>= 1;
+  }
+  return u16crc;
+#endif
+}
+
+#if MODBUS_CRC == MODBUS_CRC_SLICE8
+/**
+ * @brief
+ * Slice-by-8 tables: row k holds the CRC of a byte followed by k zero bytes.
+ * They are derived from au16CRCTable the first time they are needed.
+ */
+struct CRCSlices {
+  uint16_t au16row[8][256];
+
+  CRCSlices() {
+    for (uint16_t i = 0; i < 256; i++) {
+      au16row[0][i] = pgm_read_word( &au16CRCTable[i] );
+    }
+    for (uint8_t k = 1; k < 8; k++) {
+      for (uint16_t i = 0; i < 256; i++) {
+        uint16_t u16prev = au16row[k - 1][i];
+        au16row[k][i] = (u16prev >> 8) ^ au16row[0][ u16prev & 0xff ];
+      }
+    }
+  }
+};
+#endif
+
+/**
+ * @brief
+ * Adds a block of bytes to a running CRC-16/Modbus remainder
+ *
+ * @param u16crc  current remainder, 0xFFFF at the start of a frame
+ * @param pu8data first byte of the block
+ * @param u16length number of bytes in the block
+ * @return updated remainder
+ * @ingroup buffer
+ */
+static inline uint16_t crc16Block( uint16_t u16crc, const uint8_t *pu8data, uint16_t u16length ) {
+#if MODBUS_CRC == MODBUS_CRC_SLICE8
+  static const CRCSlices slices;
+
+  while (u16length >= 8) {
+    u16crc ^= pu8data[0] | (pu8data[1] << 8);
+    u16crc = slices.au16row[7][ u16crc & 0xff ] ^ slices.au16row[6][ u16crc >> 8 ]
+      ^ slices.au16row[5][ pu8data[2] ] ^ slices.au16row[4][ pu8data[3] ]
+      ^ slices.au16row[3][ pu8data[4] ] ^ slices.au16row[2][ pu8data[5] ]
+      ^ slices.au16row[1][ pu8data[6] ] ^ slices.au16row[0][ pu8data[7] ];
+    pu8data += 8;
+    u16length -= 8;
+  }
+#endif
+  while (u16length--) {
+    u16crc = crc16Update( u16crc, *pu8data++ );
+  }
+  return u16crc;
+}
+
+/**
+ * @brief
+ * Verifies the CRC of a batch of captured frames.
+ * It is a convenience wrapper: each frame goes through crc16Block(),
+ * the slice-by-8 engine on hosts, one after the other. That engine is
+ * bound by its table loads, walking several frames in lockstep does not
+ * make it faster.
+ *
+ * @param frames   array of frames, each including its 2 CRC bytes
+ * @param u32count number of frames in the array
+ * @param au8valid bitmap, bit (i % 8) of byte (i / 8) is set if frame i is valid
+ * @return number of valid frames
+ * @ingroup buffer
+ */
+static inline uint32_t crc16CheckFrames( const modbus_frame_t *frames, uint32_t u32count, uint8_t *au8valid ) {
+  uint32_t u32good = 0;
+
+  memset( au8valid, 0, (u32count + 7) / 8 );
+  for (uint32_t i = 0; i < u32count; i++) {
+    const modbus_frame_t *frame = &frames[i];
+    // a frame is valid when the CRC of its data and CRC bytes is 0
+    if ((frame->u16length > CHECKSUM_SIZE) && (crc16Block( 0xFFFF, frame->pu8data, frame->u16length ) == 0)) {
+      au8valid[ i / 8 ] |= 1 << (i % 8);
+      u32good++;
+    }
+  }
+  return u32good;
+}
+
+#if MODBUS_RESPONSE_CACHE > 0
+/**
+ * @struct modbus_cache_t
+ * @brief
+ * Answer kept in the response cache
+ */
+typedef struct {
+  uint8_t au8request[ 6 ];  /*!< Id, function, address and quantity of the request */
+  uint16_t u16version;      /*!< Table version the answer was encoded from */
+  uint16_t u16crc;          /*!< CRC of the answer */
+  uint8_t u8length;         /*!< Answer length without the CRC, 0 for a free entry */
+  uint8_t au8answer[ MODBUS_CACHE_BYTES ];
+}
+modbus_cache_t;
+#endif
 
 /**
  * @class Modbus 
@@ -144,36 +736,104 @@ const unsigned char fctsupported[] = {
  */
 class Modbus {
 private:
-  HardwareSerial *port; //!< Pointer to Serial class object
+  ModbusPort *port; //!< Pointer to Serial class object
   uint8_t u8id; //!< 0=master, 1..247=slave number
   uint8_t u8serno; //!< serial port: 0-Serial, 1..3-Serial1..Serial3
   uint8_t u8txenpin; //!< flow control pin: 0=USB or RS-232 mode, >0=RS-485 mode
-  uint8_t u8state;
+  volatile uint8_t u8state; //!< COM_STATES, COM_SENDING is left from the TX complete interrupt
   uint8_t u8lastError;
+#if MODBUS_SHARED_BUFFERS > 0
+  uint8_t *au8Buffer; //!< buffer borrowed from au8Pool, NULL between frames
+  static uint8_t au8Pool[ MODBUS_SHARED_BUFFERS ][ MAX_BUFFER ];
+  static volatile uint8_t u8PoolUsed; //!< bit n set while au8Pool[n] is borrowed
+#else
   uint8_t au8Buffer[MAX_BUFFER];
-  uint8_t u8BufferSize;
-  uint8_t u8lastRec;
-  uint16_t *au16regs;
+#endif
+  uint16_t u16BufferSize;
+  uint8_t u8rxState; //!< RX_STATES of the frame being received
+#if MODBUS_RX_RING > 0
+  volatile uint8_t u8ringHead; //!< next slot written by rxInterrupt(), only it moves the head
+  volatile uint8_t u8ringTail; //!< next slot read by the engine, only it moves the tail
+  volatile uint8_t au8ring[ MODBUS_RX_RING ];
+  volatile uint32_t au32ringTime[ MODBUS_RX_RING ]; //!< arrival time of each byte in us
+#endif
+  uint16_t u16RxCRC; //!< running CRC of the received bytes, 0 for a valid frame
+  uint16_t u16TxCRC; //!< running CRC of the bytes sent since txBegin()
+  uint16_t *au16regs; //!< master: data of the pending query
+  const modbus_segment_t *apSegments[ MB_TABLES_NO ]; //!< segments of each MB_TABLES
+  uint8_t au8segments[ MB_TABLES_NO ]; //!< number of segments of each table
+  modbus_segment_t aWholeTable[ MB_TABLES_NO ]; //!< single segment set by setCoils()...
+  volatile uint8_t u8dirtyTables; //!< bit n set when a segment of table n may hold dirty entries
+  volatile uint8_t u8frontTables; //!< bit n set when image 1 of the SEG_DOUBLE segments of table n is read
+  volatile uint8_t u8readTable; //!< MB_TABLES being encoded from image u8readImage, MB_TABLES_NO if none
+  volatile uint8_t u8readImage; //!< image of u8readTable latched by latchImage()
+  const modbus_hook_t *pWriteHooks; //!< hooks called after a write of the master
+  uint8_t u8writeHooks; //!< number of write hooks
+  modbus_read_hook_t *pReadHooks; //!< hooks called before a read of the master
+  uint8_t u8readHooks; //!< number of read hooks
+#if MODBUS_RESPONSE_CACHE > 0
+  modbus_cache_t aCache[ MODBUS_RESPONSE_CACHE ];
+  uint8_t u8cacheNext; //!< next entry replaced on a miss
+  uint16_t u16version; //!< bumped by every change of the tables
+  uint16_t u16cacheHits, u16cacheMisses;
+#endif
   uint16_t u16InCnt, u16OutCnt, u16errCnt;
   uint16_t u16timeOut;
   uint32_t u32time, u32timeOut;
-  uint8_t u8regsize;
+  uint32_t u32T15, u32T35; //!< inter-character and inter-frame silent intervals in us
 
   void init(uint8_t u8id, uint8_t u8serno, uint8_t u8txenpin);
   void sendTxBuffer(); 
-  int8_t getRxBuffer(); 
-  uint16_t calcCRC(uint8_t u8length);
+  void txBegin();
+  void txWrite( const uint8_t *pu8data, uint16_t u16length );
+  void txEnd();
+  void rxByte( uint8_t u8byte, uint32_t u32now );
+  uint16_t frameLength();
+  int16_t getRxBuffer(); 
   uint8_t validateAnswer();
   uint8_t validateRequest(); 
+#if MODBUS_FUNCTIONS & (MODBUS_FC1 | MODBUS_FC2)
   void get_FC1(); 
+  int16_t process_FC1( uint8_t u8table ); 
+#endif
+#if MODBUS_FUNCTIONS & (MODBUS_FC3 | MODBUS_FC4)
   void get_FC3(); 
-  int8_t process_FC1( uint16_t *regs, uint8_t u8size ); 
-  int8_t process_FC3( uint16_t *regs, uint8_t u8size ); 
-  int8_t process_FC5( uint16_t *regs, uint8_t u8size ); 
-  int8_t process_FC6( uint16_t *regs, uint8_t u8size ); 
-  int8_t process_FC15( uint16_t *regs, uint8_t u8size ); 
-  int8_t process_FC16( uint16_t *regs, uint8_t u8size ); 
+  int16_t process_FC3( uint8_t u8table ); 
+#endif
+#if MODBUS_FUNCTIONS & MODBUS_FC5
+  int16_t process_FC5(); 
+#endif
+#if MODBUS_FUNCTIONS & MODBUS_FC6
+  int16_t process_FC6(); 
+#endif
+#if MODBUS_FUNCTIONS & MODBUS_FC15
+  int16_t process_FC15(); 
+#endif
+#if MODBUS_FUNCTIONS & MODBUS_FC16
+  int16_t process_FC16(); 
+#endif
   void buildException( uint8_t u8exception ); // build exception message
+  const modbus_segment_t *findSegment( uint8_t u8table, uint16_t u16add );
+  uint8_t validateRange( uint8_t u8table, uint16_t u16add, uint16_t u16no, boolean bWrite );
+  void markDirty( uint8_t u8table, const modbus_segment_t *segment, uint16_t u16first, uint16_t u16count );
+  void runWriteHooks( uint8_t u8table, uint16_t u16add, uint16_t u16count );
+  uint8_t latchImage( uint8_t u8table );
+  boolean runReadHooks( uint8_t u8table, uint16_t u16add, uint16_t u16count );
+#if MODBUS_RESPONSE_CACHE > 0
+  modbus_cache_t *findCache();
+  boolean isCacheable( const modbus_segment_t *segment, uint16_t u16reg, uint16_t u16regsno );
+#endif
+  void invalidateCache();
+  void setTable( uint8_t u8table, const void *pData, uint16_t u16count );
+  int16_t pollPort();
+  int16_t processFrame();
+  int16_t processAnswer();
+  int16_t processRequest();
+  void endTx();
+  boolean takeBuffer();
+  void releaseBuffer();
+  void (*txCallback)(); //!< called once a frame has left the wire
+  static Modbus *apTxOwner[4]; //!< objects waiting for TX complete, per serial port
 
 public:
   Modbus(); 
@@ -185,8 +845,29 @@ public:
   uint16_t getTimeOut(); //!<get communication watch-dog timer value
   boolean getTimeOutState(); //!<get communication watch-dog timer state
   int8_t query( modbus_t telegram ); //!<only for master
-  int8_t poll(); //!<cyclic poll for master
-  int8_t poll( uint16_t *regs, uint8_t u8size ); //!<cyclic poll for slave
+  int16_t poll(); //!<cyclic poll for master, or for a slave with its own tables
+  int16_t poll( uint16_t *regs, uint8_t u8size ); //!<cyclic poll for slave
+  void setRegisters( uint16_t *regs, uint8_t u8size ); //!<one word table for all four slave tables
+  void setCoils( uint8_t *coils, uint16_t u16count ); //!<coil table, bit n%8 of byte n/8
+  void setDiscreteInputs( const uint8_t *inputs, uint16_t u16count ); //!<discrete input table, packed as coils
+  void setHoldingRegisters( uint16_t *regs, uint16_t u16count ); //!<holding register table
+  void setInputRegisters( const uint16_t *regs, uint16_t u16count ); //!<input register table
+  void setSegments( uint8_t u8table, const modbus_segment_t *segments, uint8_t u8count ); //!<sparse slave table
+  boolean takeDirty( uint8_t u8table, uint16_t *pu16add, uint16_t *pu16count ); //!<next range written by the master
+  void setWriteHooks( const modbus_hook_t *hooks, uint8_t u8count ); //!<functions called when the master writes a range
+  void setReadHooks( modbus_read_hook_t *hooks, uint8_t u8count ); //!<functions called before the master reads a range
+  void *getBackImage( uint8_t u8table, const modbus_segment_t *segment ); //!<image of a SEG_DOUBLE segment to update
+  void publish( uint8_t u8table ); //!<swap the images of the SEG_DOUBLE segments of a table
+  uint16_t getCacheHits(); //!<number of answers sent from the response cache
+  uint16_t getCacheMisses(); //!<number of cacheable answers that had to be encoded
+  int16_t feedByte( uint8_t u8byte ); //!<push one received byte, from a UART ISR or event loop
+  int16_t onSilence(); //!<push the end of a T3.5 silent interval
+#if MODBUS_RX_RING > 0
+  void rxInterrupt( uint8_t u8byte ); //!<queue one byte from the UART RX interrupt
+#endif
+  uint32_t getT35(); //!<get the T3.5 silent interval in us
+  void setTxCallback( void (*txCallback)() ); //!<function called when a frame has been sent
+  static void txInterrupt( uint8_t u8serno ); //!<TX complete interrupt of serial port u8serno
   uint16_t getInCnt(); //!<number of incoming messages
   uint16_t getOutCnt(); //!<number of outcoming messages
   uint16_t getErrCnt(); //!<error counter
@@ -197,6 +878,12 @@ public:
   void end(); //!<finish any communication and release serial communication port
 };
 
+/*
+ * The methods are compiled in the sketch that includes this file.
+ * Elsewhere ModbusRtu.cpp compiles them once, with MODBUS_IMPLEMENTATION.
+ */
+#if defined(ARDUINO) || defined(MODBUS_IMPLEMENTATION)
+
 /* _____PUBLIC FUNCTIONS_____________________________________________________ */
 
 /**
@@ -244,6 +931,7 @@ Modbus::Modbus(uint8_t u8id, uint8_t u8serno, uint8_t u8txenpin) {
  * Initialize class object.
  * 
  * Sets up the serial port using specified baud rate.
+ * The T1.5 and T3.5 silent intervals are derived from it.
  * Call once class has been instantiated, typically within setup().
  * 
  * @see http://arduino.cc/en/Serial/Begin#.Uy4CJ6aKlHY
@@ -253,40 +941,32 @@ Modbus::Modbus(uint8_t u8id, uint8_t u8serno, uint8_t u8txenpin) {
  */
 void Modbus::begin(long u32speed) {
 
-  switch( u8serno ) {
-#if defined(UBRR1H)
-  case 1:
-    port = &Serial1;
-    break;
-#endif
-
-#if defined(UBRR2H)
-  case 2:
-    port = &Serial2;
-    break;
-#endif
-
-#if defined(UBRR3H)
-  case 3:
-    port = &Serial3;
-    break;
-#endif
-  case 0:
-  default:
-    port = &Serial;
-    break;
-  }
+  port = halPort( u8serno );
 
   // port->begin(u32speed, u8config);
   port->begin(u32speed);
   if (u8txenpin > 1) { // pin 0 & pin 1 are reserved for RX/TX
-    // return RS485 transceiver to transmit mode
-    pinMode(u8txenpin, OUTPUT);
-    digitalWrite(u8txenpin, LOW);
+    // return RS485 transceiver to receive mode
+    halPinSetup( port, u8txenpin );
+  }
+
+  // silent intervals are 1.5 and 3.5 characters of 11 bits,
+  // fixed to 750 us and 1750 us above 19200 baud
+  if (u32speed > 19200) {
+    u32T15 = 750;
+    u32T35 = 1750;
+  }
+  else {
+    u32T15 = 16500000UL / u32speed;
+    u32T35 = 38500000UL / u32speed;
   }
 
+#if defined(MODBUS_NO_TX_ISR)
+  // with MODBUS_TX_ISR the TXC flag that flush() waits for is consumed by the interrupt
   port->flush();
-  u8lastRec = u8BufferSize = 0;
+#endif
+  u16BufferSize = 0;
+  u8rxState = RX_IDLE;
   u16InCnt = u16OutCnt = u16errCnt = 0;
 }
 
@@ -348,11 +1028,11 @@ void Modbus::setTimeOut( uint16_t u16timeOut) {
  * Return communication Watchdog state.
  * It could be usefull to reset outputs if the watchdog is fired.
  *
- * @return TRUE if millis() > u32timeOut
+ * @return TRUE if halMillis() > u32timeOut
  * @ingroup loop
  */
 boolean Modbus::getTimeOutState() {
-  return (millis() > u32timeOut);
+  return (halMillis() > u32timeOut);
 }
 
 /**
@@ -427,19 +1107,42 @@ uint8_t Modbus::getLastError() {
  * @todo finish function 15
  */
 int8_t Modbus::query( modbus_t telegram ) {
-  uint8_t u8regsno, u8bytesno;
+  uint16_t u16regsno, u16bytesno;
   if (u8id!=0) return -2;
   if (u8state != COM_IDLE) return -1;
 
   if ((telegram.u8id==0) || (telegram.u8id>247)) return -3;
 
-  au16regs = telegram.au16reg;
-
-  // telegram header
-  au8Buffer[ ID ]         = telegram.u8id;
-  au8Buffer[ FUNC ]       = telegram.u8fct;
-  au8Buffer[ ADD_HI ]     = highByte(telegram.u16RegAdd );
-  au8Buffer[ ADD_LO ]     = lowByte( telegram.u16RegAdd );
+  // the query and its answer must both fit in au8Buffer
+  switch( telegram.u8fct ) {
+  case MB_FC_READ_COILS:
+  case MB_FC_READ_DISCRETE_INPUT:
+    u16bytesno = 3 + (telegram.u16CoilsNo + 7) / 8;
+    break;
+  case MB_FC_READ_REGISTERS:
+  case MB_FC_READ_INPUT_REGISTER:
+    u16bytesno = 3 + telegram.u16CoilsNo * 2;
+    break;
+  case MB_FC_WRITE_MULTIPLE_COILS:
+    u16bytesno = BYTE_CNT + 1 + (telegram.u16CoilsNo + 7) / 8;
+    break;
+  case MB_FC_WRITE_MULTIPLE_REGISTERS:
+    u16bytesno = BYTE_CNT + 1 + telegram.u16CoilsNo * 2;
+    break;
+  default:
+    u16bytesno = RESPONSE_SIZE;
+    break;
+  }
+  if (u16bytesno + CHECKSUM_SIZE > MAX_BUFFER) return ERR_BUFF_OVERFLOW;
+  if (!takeBuffer()) return -1;
+
+  au16regs = telegram.au16reg;
+
+  // telegram header
+  au8Buffer[ ID ]         = telegram.u8id;
+  au8Buffer[ FUNC ]       = telegram.u8fct;
+  au8Buffer[ ADD_HI ]     = highByte(telegram.u16RegAdd );
+  au8Buffer[ ADD_LO ]     = lowByte( telegram.u16RegAdd );
 
   switch( telegram.u8fct ) {
   case MB_FC_READ_COILS:
@@ -448,32 +1151,32 @@ int8_t Modbus::query( modbus_t telegram ) {
   case MB_FC_READ_INPUT_REGISTER:
     au8Buffer[ NB_HI ]      = highByte(telegram.u16CoilsNo );
     au8Buffer[ NB_LO ]      = lowByte( telegram.u16CoilsNo );
-    u8BufferSize = 6;
+    u16BufferSize = 6;
     break;
   case MB_FC_WRITE_COIL:
     au8Buffer[ NB_HI ]      = ((au16regs[0] > 0) ? 0xff : 0);
     au8Buffer[ NB_LO ]      = 0;
-    u8BufferSize = 6;    
+    u16BufferSize = 6;    
     break;
   case MB_FC_WRITE_REGISTER:
     au8Buffer[ NB_HI ]      = highByte(au16regs[0]);
     au8Buffer[ NB_LO ]      = lowByte(au16regs[0]);
-    u8BufferSize = 6;    
+    u16BufferSize = 6;    
     break;
   case MB_FC_WRITE_MULTIPLE_COILS: // TODO: implement "sending coils"
-    u8regsno = telegram.u16CoilsNo / 16;
-    u8bytesno = u8regsno * 2;
+    u16regsno = telegram.u16CoilsNo / 16;
+    u16bytesno = u16regsno * 2;
     if ((telegram.u16CoilsNo % 16) != 0) {
-      u8bytesno++;
-      u8regsno++;
+      u16bytesno++;
+      u16regsno++;
     }
 
     au8Buffer[ NB_HI ]      = highByte(telegram.u16CoilsNo );
     au8Buffer[ NB_LO ]      = lowByte( telegram.u16CoilsNo );
-    au8Buffer[ NB_LO+1 ]    = u8bytesno;
-    u8BufferSize = 7;
+    au8Buffer[ NB_LO+1 ]    = u16bytesno;
+    u16BufferSize = 7;
 
-    u8regsno = u8bytesno = 0; // now auxiliary registers
+    u16regsno = u16bytesno = 0; // now auxiliary registers
     for (uint16_t i = 0; i < telegram.u16CoilsNo; i++) {
 
 
@@ -484,24 +1187,19 @@ int8_t Modbus::query( modbus_t telegram ) {
     au8Buffer[ NB_HI ]      = highByte(telegram.u16CoilsNo );
     au8Buffer[ NB_LO ]      = lowByte( telegram.u16CoilsNo );
     au8Buffer[ NB_LO+1 ]    = (uint8_t) ( telegram.u16CoilsNo * 2 );
-    u8BufferSize = 7;    
+    u16BufferSize = 7;    
 
-    for (uint16_t i=0; i< telegram.u16CoilsNo; i++) {
-      au8Buffer[ u8BufferSize ] = highByte( au16regs[ i ] );
-      u8BufferSize++;
-      au8Buffer[ u8BufferSize ] = lowByte( au16regs[ i ] );
-      u8BufferSize++;
-    }
+    encodeRegisters( &au8Buffer[ u16BufferSize ], au16regs, telegram.u16CoilsNo );
+    u16BufferSize += telegram.u16CoilsNo * 2;
     break;
   }
 
   sendTxBuffer();
-  u8state = COM_WAITING;
   return 0;
 }
 
 /**
- * @brief *** Only for Modbus Master ***
+ * @brief
  * This method checks if there is any incoming answer if pending.
  * If there is no answer, it would change Master state to COM_IDLE.
  * This method must be called only at loop section.
@@ -509,39 +1207,680 @@ int8_t Modbus::query( modbus_t telegram ) {
  *
  * Any incoming data would be redirected to au16regs pointer,
  * as defined in its modbus_t query telegram.
+ * A slave whose tables were set with setCoils(), setHoldingRegisters()...
+ * answers its queries here, like poll( regs, u8size ).
  * 
  * @params	nothing
  * @return errors counter
  * @ingroup loop
  */
-int8_t Modbus::poll() {
-  // check if there is any incoming frame
-  uint8_t u8current = port->available();  
-
-  if (millis() > u32timeOut) {
+int16_t Modbus::poll() {
+  if ((u8id == 0) && (halMillis() > u32timeOut)) {
     u8state = COM_IDLE;
     u8lastError = NO_REPLY;
     u16errCnt++;
     return 0;
   }
 
-  if (u8current == 0) return 0;
+  return pollPort();
+}
+
+/**
+ * @brief
+ * *** Only for Modbus Slave ***
+ * This method checks if there is any incoming query
+ * Afterwards, it would shoot a validation routine plus a register query
+ * Avoid any delay() function !!!!
+ * After a successful frame between the Master and the Slave, the time-out timer is reset.
+ * 
+ * @param *regs  register table for communication exchange
+ * @param u8size  size of the register table
+ * @return 0 if no query, 1..4 if communication error, >4 if correct query processed
+ * @ingroup loop
+ */
+int16_t Modbus::poll( uint16_t *regs, uint8_t u8size ) {
+  setRegisters( regs, u8size );
+
+  return pollPort();
+}
+
+/**
+ * @brief
+ * *** Only for Modbus Slave ***
+ * Serves the four Modbus tables from a single word array, as poll( regs, u8size ).
+ * Coil and discrete input n is bit n%16 of word n/16: on little endian
+ * targets such as AVR it is also bit n%8 of byte n/8, the packed layout
+ * of setCoils().
+ * Useful when the engine is driven through feedByte() and onSilence().
+ *
+ * @param *regs  register table for communication exchange
+ * @param u8size  size of the register table
+ * @ingroup setup
+ */
+void Modbus::setRegisters( uint16_t *regs, uint8_t u8size ) {
+  setCoils( (uint8_t *) regs, u8size * 16 );
+  setDiscreteInputs( (const uint8_t *) regs, u8size * 16 );
+  setHoldingRegisters( regs, u8size );
+  setInputRegisters( regs, u8size );
+}
+
+/**
+ * @brief
+ * *** Only for Modbus Slave ***
+ * Sets the coils read by FC1 and written by FC5 and FC15
+ *
+ * @param coils  coil n is bit n%8 of byte n/8
+ * @param u16count  number of coils
+ * @ingroup setup
+ */
+void Modbus::setCoils( uint8_t *coils, uint16_t u16count ) {
+  setTable( MB_COILS, coils, u16count );
+}
+
+/**
+ * @brief
+ * *** Only for Modbus Slave ***
+ * Sets the discrete inputs read by FC2
+ *
+ * @param inputs  input n is bit n%8 of byte n/8
+ * @param u16count  number of inputs
+ * @ingroup setup
+ */
+void Modbus::setDiscreteInputs( const uint8_t *inputs, uint16_t u16count ) {
+  setTable( MB_DISCRETE_INPUTS, inputs, u16count );
+}
+
+/**
+ * @brief
+ * *** Only for Modbus Slave ***
+ * Sets the holding registers read by FC3 and written by FC6 and FC16
+ *
+ * @param regs  register table
+ * @param u16count  number of registers
+ * @ingroup setup
+ */
+void Modbus::setHoldingRegisters( uint16_t *regs, uint16_t u16count ) {
+  setTable( MB_HOLDING_REGISTERS, regs, u16count );
+}
+
+/**
+ * @brief
+ * *** Only for Modbus Slave ***
+ * Sets the input registers read by FC4
+ *
+ * @param regs  register table
+ * @param u16count  number of registers
+ * @ingroup setup
+ */
+void Modbus::setInputRegisters( const uint16_t *regs, uint16_t u16count ) {
+  setTable( MB_INPUT_REGISTERS, regs, u16count );
+}
+
+/**
+ * @brief
+ * *** Only for Modbus Slave ***
+ * Publishes a table as a list of segments, so that sparse addresses
+ * such as 1000, 41000 and 45000 need no dense array.
+ * A request may span adjacent segments, but not a gap between them.
+ * Writes to SEG_READONLY, SEG_FLASH or SEG_DOUBLE segments answer EXC_ADDR_RANGE.
+ *
+ * @param u8table  MB_TABLES
+ * @param segments  array sorted by u16start, it must stay valid while polling
+ * @param u8count  number of segments, 0 for an empty table
+ * @ingroup setup
+ */
+void Modbus::setSegments( uint8_t u8table, const modbus_segment_t *segments, uint8_t u8count ) {
+  if (u8table >= MB_TABLES_NO) return;
+  apSegments[ u8table ] = segments;
+  au8segments[ u8table ] = u8count;
+  invalidateCache();
+}
+
+/**
+ * @brief
+ * Publishes a whole table as one segment starting at address 0
+ *
+ * @ingroup setup
+ */
+void Modbus::setTable( uint8_t u8table, const void *pData, uint16_t u16count ) {
+  modbus_segment_t *segment = &aWholeTable[ u8table ];
+
+  // poll( regs, size ) sets the same tables on every call
+  if ((apSegments[ u8table ] == segment) && (segment->pData == pData) && (segment->u16length == u16count)) return;
+  segment->u16start = 0;
+  segment->u16length = u16count;
+  segment->pData = pData;
+  segment->u8flags = 0;
+  segment->pu8dirty = NULL;
+  setSegments( u8table, segment, (pData == NULL || u16count == 0) ? 0 : 1 );
+}
+
+/**
+ * @brief
+ * *** Only for Modbus Slave ***
+ * Returns the image of a SEG_DOUBLE segment that the master does not read,
+ * where the application builds the next snapshot. It holds the snapshot
+ * published before the last one: write all of its entries before publish().
+ * When publish() runs from an interrupt, a request that started before
+ * it may still be encoding this image: NULL is returned until it is done.
+ *
+ * @param u8table  MB_TABLES of the segment
+ * @param segment  SEG_DOUBLE segment of the table
+ * @return coil array or register array of the back image, NULL if it is still read
+ * @ingroup setup
+ */
+void *Modbus::getBackImage( uint8_t u8table, const modbus_segment_t *segment ) {
+  uint8_t u8back = !((u8frontTables >> u8table) & 1);
+
+  if ((u8readTable == u8table) && (u8readImage == u8back)) return NULL;
+  return segmentImage( segment, u8table, u8back );
+}
+
+/**
+ * @brief
+ * *** Only for Modbus Slave ***
+ * Makes the back images of all the SEG_DOUBLE segments of a table the
+ * ones read by the master, with a single flag swap. A 32-bit value or a
+ * float written in two registers of the back image is never seen half
+ * updated: FC1 to FC4 take the front image once per request, and the
+ * encoding runs without disabling interrupts. The image a request still
+ * reads is not handed out by getBackImage() until the request is done.
+ *
+ * @param u8table  MB_TABLES
+ * @ingroup loop
+ */
+void Modbus::publish( uint8_t u8table ) {
+  if (u8table >= MB_TABLES_NO) return;
+
+  uint8_t u8sreg = halLock();
+  u8frontTables ^= (1 << u8table);
+  halUnlock( u8sreg );
+  invalidateCache();
+}
+
+/**
+ * @brief
+ * This method takes the front image of the SEG_DOUBLE segments of a table
+ * for the request being answered, until u8readTable is reset
+ *
+ * @param u8table  MB_TABLES read
+ * @return image to read, 0 or 1
+ * @ingroup buffer
+ */
+uint8_t Modbus::latchImage( uint8_t u8table ) {
+  // publish() may run from an interrupt between the two
+  uint8_t u8sreg = halLock();
+  u8readImage = (u8frontTables >> u8table) & 1;
+  u8readTable = u8table;
+  halUnlock( u8sreg );
+  return u8readImage;
+}
+
+/**
+ * @brief
+ * *** Only for Modbus Slave ***
+ * Returns the next range of a table written by the master since it was
+ * last taken, and clears it. Only segments with a dirty bitmap are tracked.
+ * Coils come in whole bytes of 8, clipped to their segment.
+ * Call it in a loop until it returns FALSE, the work done is proportional
+ * to the changes and not to the size of the table when nothing changed.
+ *
+ * @param u8table  MB_TABLES
+ * @param pu16add  first address of the range
+ * @param pu16count  number of coils or registers of the range
+ * @return TRUE if a range was found
+ * @ingroup loop
+ */
+boolean Modbus::takeDirty( uint8_t u8table, uint16_t *pu16add, uint16_t *pu16count ) {
+  if ((u8table >= MB_TABLES_NO) || !(u8dirtyTables & (1 << u8table))) return false;
+
+  // cleared first, so that a write during the scan raises it again
+  uint8_t u8sreg = halLock();
+  u8dirtyTables &= ~(1 << u8table);
+  halUnlock( u8sreg );
+
+  uint8_t u8scale = (u8table <= MB_DISCRETE_INPUTS) ? 8 : 1;
+  for (uint8_t s = 0; s < au8segments[ u8table ]; s++) {
+    const modbus_segment_t *segment = &apSegments[ u8table ][ s ];
+    uint8_t *pu8dirty = segment->pu8dirty;
+    uint16_t u16bits = (segment->u16length + u8scale - 1) / u8scale;
+    uint32_t i, j;
+
+    if (pu8dirty == NULL) continue;
+    for (i = 0; i < u16bits; i++) {
+      if (pu8dirty[ i >> 3 ] == 0) {
+        i |= 7;
+        continue;
+      }
+      if (!bitRead( pu8dirty[ i >> 3 ], i & 7 )) continue;
+
+      // take the whole run of dirty bits
+      u8sreg = halLock();
+      for (j = i; (j < u16bits) && bitRead( pu8dirty[ j >> 3 ], j & 7 ); j++) {
+        bitClear( pu8dirty[ j >> 3 ], j & 7 );
+      }
+      u8dirtyTables |= (1 << u8table);
+      halUnlock( u8sreg );
+
+      *pu16add = segment->u16start + i * u8scale;
+      *pu16count = ((j * u8scale < segment->u16length) ? j * u8scale : segment->u16length) - i * u8scale;
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * @brief
+ * This method flags entries of a segment as written by the master
+ *
+ * @param u8table  MB_TABLES of the segment
+ * @param segment  segment written
+ * @param u16first  first coil or register, from the start of the segment
+ * @param u16count  number of coils or registers
+ * @ingroup buffer
+ */
+void Modbus::markDirty( uint8_t u8table, const modbus_segment_t *segment, uint16_t u16first, uint16_t u16count ) {
+  uint8_t *pu8dirty = segment->pu8dirty;
+  uint16_t i, u16last;
+
+  if ((pu8dirty == NULL) || (u16count == 0)) return;
+
+  u16last = u16first + u16count - 1;
+  if (u8table <= MB_DISCRETE_INPUTS) {
+    // one bit per byte of 8 coils
+    u16first >>= 3;
+    u16last >>= 3;
+  }
+  for (i = u16first; i <= u16last; i++) bitSet( pu8dirty[ i >> 3 ], i & 7 );
+  u8dirtyTables |= (1 << u8table);
+}
+
+/**
+ * @brief
+ * *** Only for Modbus Slave ***
+ * Sets functions called as soon as the master writes their range,
+ * instead of waiting for the next pass of the loop.
+ * A hook is called once per request, with the part of its range that
+ * was written, after the write is applied and before the answer is sent,
+ * so an output switches no later than the master hears the answer, also
+ * when sendTxBuffer() waits for the RS-485 line to drain.
+ * Hooks run in the context of poll() or feedByte() and delay the answer:
+ * they must be short.
+ *
+ * @param hooks  array of hooks, it must stay valid while polling
+ * @param u8count  number of hooks, 0 for none
+ * @ingroup setup
+ */
+void Modbus::setWriteHooks( const modbus_hook_t *hooks, uint8_t u8count ) {
+  pWriteHooks = hooks;
+  u8writeHooks = u8count;
+}
+
+/**
+ * @brief
+ * This method calls the write hooks that overlap a range written by the master
+ *
+ * @param u8table  MB_TABLES written
+ * @param u16add  first coil or register written
+ * @param u16count  number of coils or registers written
+ * @ingroup buffer
+ */
+void Modbus::runWriteHooks( uint8_t u8table, uint16_t u16add, uint16_t u16count ) {
+  uint16_t u16first, u16no;
+
+  for (uint8_t i = 0; i < u8writeHooks; i++) {
+    const modbus_hook_t *hook = &pWriteHooks[ i ];
+    if (hook->u8table != u8table) continue;
+    if (hookRange( hook->u16start, hook->u16length, u16add, u16count, &u16first, &u16no )) {
+      hook->callback( u8table, u16first, u16no );
+    }
+  }
+}
+
+/**
+ * @brief
+ * *** Only for Modbus Slave ***
+ * Sets functions called before the slave answers a read of their range,
+ * so that ADCs or inputs are only sampled when the master asks for them
+ * instead of on every pass of the loop.
+ * A hook is called once per request, with the part of its range that is
+ * read, and must update the table before it returns.
+ * With u16maxAge, a read within that many ms of the last call reuses the
+ * previous sample, whatever part of the range it covers: such a hook
+ * should then sample its whole range.
+ *
+ * @param hooks  array of hooks, it must stay valid and writable while polling
+ * @param u8count  number of hooks, 0 for none
+ * @ingroup setup
+ */
+void Modbus::setReadHooks( modbus_read_hook_t *hooks, uint8_t u8count ) {
+  pReadHooks = hooks;
+  u8readHooks = u8count;
+  for (uint8_t i = 0; i < u8count; i++) hooks[ i ].u8sampled = 0;
+}
+
+/**
+ * @brief
+ * This method calls the read hooks that overlap a range read by the master,
+ * unless their last sample is recent enough
+ *
+ * @param u8table  MB_TABLES read
+ * @param u16add  first coil, input or register read
+ * @param u16count  number of coils, inputs or registers read
+ * @return TRUE if a hook overlaps the range, the answer must then be encoded
+ * @ingroup buffer
+ */
+boolean Modbus::runReadHooks( uint8_t u8table, uint16_t u16add, uint16_t u16count ) {
+  uint16_t u16first, u16no;
+  uint32_t u32now = halMillis();
+  boolean bHooked = false;
+
+  for (uint8_t i = 0; i < u8readHooks; i++) {
+    modbus_read_hook_t *hook = &pReadHooks[ i ];
+    if (hook->u8table != u8table) continue;
+    if (!hookRange( hook->u16start, hook->u16length, u16add, u16count, &u16first, &u16no )) continue;
+    bHooked = true;
+    if (hook->u8sampled && (hook->u16maxAge > 0)
+      && ((unsigned long)(u32now - hook->u32last) < hook->u16maxAge)) continue;
+
+    hook->callback( u8table, u16first, u16no );
+    hook->u32last = u32now;
+    hook->u8sampled = 1;
+  }
+  return bHooked;
+}
+
+/**
+ * @brief
+ * This method drops the answers of the response cache
+ * when publish() or setSegments() change the cached segments
+ *
+ * @ingroup buffer
+ */
+void Modbus::invalidateCache() {
+#if MODBUS_RESPONSE_CACHE > 0
+  uint8_t u8sreg = halLock();
+  // an entry is only valid for the version it was encoded from,
+  // they are all freed when the counter wraps
+  if (++u16version == 0) {
+    for (uint8_t i = 0; i < MODBUS_RESPONSE_CACHE; i++) aCache[ i ].u8length = 0;
+  }
+  halUnlock( u8sreg );
+#endif
+}
+
+/**
+ * @brief
+ * Number of FC3/FC4 answers sent from the response cache
+ *
+ * @return hits counter, 0 without MODBUS_RESPONSE_CACHE
+ * @ingroup buffer
+ */
+uint16_t Modbus::getCacheHits() {
+#if MODBUS_RESPONSE_CACHE > 0
+  return u16cacheHits;
+#else
+  return 0;
+#endif
+}
+
+/**
+ * @brief
+ * Number of FC3/FC4 answers that could be cached but were not found
+ *
+ * @return misses counter, 0 without MODBUS_RESPONSE_CACHE
+ * @ingroup buffer
+ */
+uint16_t Modbus::getCacheMisses() {
+#if MODBUS_RESPONSE_CACHE > 0
+  return u16cacheMisses;
+#else
+  return 0;
+#endif
+}
+
+#if MODBUS_RESPONSE_CACHE > 0
+/**
+ * @brief
+ * This method looks up the request in au8Buffer in the response cache
+ *
+ * @return the entry holding its answer, NULL if there is none for the current tables
+ * @ingroup buffer
+ */
+modbus_cache_t *Modbus::findCache() {
+  for (uint8_t i = 0; i < MODBUS_RESPONSE_CACHE; i++) {
+    modbus_cache_t *entry = &aCache[ i ];
+    if ((entry->u8length > 0) && (entry->u16version == u16version)
+      && (memcmp( entry->au8request, au8Buffer, sizeof( entry->au8request ) ) == 0)) return entry;
+  }
+  return NULL;
+}
+
+/**
+ * @brief
+ * This method tells whether an FC3/FC4 answer may be cached,
+ * that is when all the segments it reads are SEG_FLASH or SEG_DOUBLE
+ *
+ * @param segment  first segment read
+ * @param u16reg  first register read in this segment
+ * @param u16regsno  number of registers read
+ * @return true if the answer changes only with the cache version
+ * @ingroup buffer
+ */
+boolean Modbus::isCacheable( const modbus_segment_t *segment, uint16_t u16reg, uint16_t u16regsno ) {
+  // validateRequest() checked that the segments follow each other
+  uint32_t u32left = (uint32_t) u16reg + u16regsno;
+
+  for (;;) {
+    if (!(segment->u8flags & (SEG_FLASH | SEG_DOUBLE))) return false;
+    if (u32left <= segment->u16length) return true;
+    u32left -= segment->u16length;
+    segment++;
+  }
+}
+#endif
+
+/**
+ * @brief
+ * Hands one received byte to the engine.
+ * It can be called from a UART RX interrupt or an event loop instead of poll().
+ * As soon as the frame is complete, it is processed and answered.
+ *
+ * @param u8byte  received byte
+ * @return 0 if no frame completed, otherwise the same as poll()
+ * @ingroup loop
+ */
+int16_t Modbus::feedByte( uint8_t u8byte ) {
+  rxByte( u8byte, halMicros() );
+  if (u8rxState != RX_COMPLETE) return 0;
+
+  return processFrame();
+}
+
+/**
+ * @brief
+ * Tells the engine that the line has been silent for T3.5 (see getT35())
+ * since the last byte given to feedByte().
+ * Frames whose length can not be predicted from their header end here.
+ *
+ * @return 0 if no frame completed, otherwise the same as poll()
+ * @ingroup loop
+ */
+int16_t Modbus::onSilence() {
+  switch( u8rxState ) {
+  case RX_RECEIVING:
+    u8rxState = RX_COMPLETE;
+    break;
+  case RX_COMPLETE:
+  case RX_OVERFLOW:
+    break;
+  default:
+    // nothing to process, a discarded frame may still hold a buffer
+    u8rxState = RX_IDLE;
+    releaseBuffer();
+    return 0;
+  }
+
+  int16_t i16state = processFrame();
+  // the silence that closed the frame also ends the discarding after a bad CRC
+  if (u8rxState == RX_DISCARD) u8rxState = RX_IDLE;
+  return i16state;
+}
+
+#if MODBUS_RX_RING > 0
+/**
+ * @brief
+ * Queues one received byte with its arrival time.
+ * To be called from the UART RX interrupt: it only moves the ring head,
+ * poll() only moves the tail, so no interrupt needs to be disabled.
+ * If the ring is full the byte is lost and the CRC check drops the frame.
+ * Only for a UART RX interrupt that the application owns, the AVR core
+ * keeps the ones of HardwareSerial (see MODBUS_RX_RING).
+ *
+ * @param u8byte  received byte
+ * @ingroup loop
+ */
+void Modbus::rxInterrupt( uint8_t u8byte ) {
+  uint8_t u8head = u8ringHead;
+  uint8_t u8next = (u8head + 1) & (MODBUS_RX_RING - 1);
+
+  if (u8next == u8ringTail) return;
+
+  au8ring[ u8head ] = u8byte;
+  au32ringTime[ u8head ] = halMicros();
+  u8ringHead = u8next;
+}
+#endif
+
+/**
+ * @brief
+ * Sets a function called once a frame has completely left the wire,
+ * from the TX complete interrupt in RS-485 mode with MODBUS_TX_ISR.
+ * getState() returns COM_SENDING until then.
+ *
+ * @param txCallback  function to call, NULL for none
+ * @ingroup setup
+ */
+void Modbus::setTxCallback( void (*txCallback)() ) {
+  this->txCallback = txCallback;
+}
+
+/**
+ * @brief
+ * Finishes the transmission of the object sending through serial port u8serno.
+ * It is called by the USART TX complete interrupts defined below with MODBUS_TX_ISR.
+ *
+ * @param u8serno  serial port 0..3
+ * @ingroup loop
+ */
+void Modbus::txInterrupt( uint8_t u8serno ) {
+  Modbus *owner = apTxOwner[ u8serno ];
+
+  if ((owner != NULL) && halTxPending( owner->port )) return;
+  apTxOwner[ u8serno ] = NULL;
+  halTxInterrupt( u8serno, false );
+
+  if (owner != NULL) owner->endTx();
+}
+
+/**
+ * @brief
+ * Get the T3.5 inter-frame silent interval for the current baud rate
+ *
+ * @return T3.5 in microseconds
+ * @ingroup setup
+ */
+uint32_t Modbus::getT35() {
+  return u32T35;
+}
+
+/* _____PRIVATE FUNCTIONS_____________________________________________________ */
+
+/**
+ * @brief
+ * This method drains the receive ring when MODBUS_RX_RING is set,
+ * then moves Serial buffer data through rxByte() as it arrives.
+ * It stops reading once a frame is complete, so the following bytes
+ * are left for the next frame.
+ * Frames whose length can not be predicted end after T3.5 of silence.
+ *
+ * With the ring, each byte carries its arrival time: a T3.5 gap before it
+ * closes the previous frame, and a gap over T1.5 inside a frame makes it
+ * incomplete, so it is discarded.
+ *
+ * @return 0 if no frame completed, otherwise the same as poll()
+ * @ingroup loop
+ */
+int16_t Modbus::pollPort() {
+#if MODBUS_RX_RING > 0
+  while (u8ringTail != u8ringHead) {
+    uint8_t u8tail = u8ringTail;
+    uint32_t u32stamp = au32ringTime[ u8tail ];
+    uint32_t u32gap = u32stamp - u32time;
+
+    if ((u8rxState == RX_RECEIVING) || (u8rxState == RX_OVERFLOW)) {
+      if (u32gap >= u32T35) return onSilence();
+      if ((u8rxState == RX_RECEIVING) && (u32gap > u32T15)) {
+        // the frame is dropped, its buffer is free for the other ports
+        u8rxState = RX_DISCARD;
+        u16errCnt++;
+        releaseBuffer();
+      }
+    }
+
+    rxByte( au8ring[ u8tail ], u32stamp );
+    u8ringTail = (u8tail + 1) & (MODBUS_RX_RING - 1);
+    if (u8rxState == RX_COMPLETE) return processFrame();
+  }
+#endif
+
+  // the core buffer of a port whose RX interrupt is not ours
+  while (port->available()) {
+    rxByte( port->read(), halMicros() );
+    if (u8rxState == RX_COMPLETE) return processFrame();
+  }
+
+  if (u8rxState == RX_IDLE) return 0;
+  if ((unsigned long)(halMicros() - u32time) < u32T35) return 0;
+  return onSilence();
+}
+
+/**
+ * @brief
+ * This method processes the complete frame in au8Buffer:
+ * an answer for the master, a query for a slave.
+ *
+ * @return the same as poll()
+ * @ingroup loop
+ */
+int16_t Modbus::processFrame() {
+  int16_t i16state;
+
+  if (u8id == 0) i16state = processAnswer();
+  else i16state = processRequest();
 
-  // check T35 after frame end or still no frame end
-  if (u8current != u8lastRec) {
-    u8lastRec = u8current;
-    u32time = millis() + T35;
-    return 0;
-  }
-  if (millis() < u32time) return 0;
+  // the frame is done with, whether it was answered or not
+  releaseBuffer();
+  return i16state;
+}
 
-  // transfer Serial buffer frame to auBuffer
-  u8lastRec = 0;
-  int8_t i8state = getRxBuffer();
-  if (i8state < 7) {
+/**
+ * @brief
+ * *** Only for Modbus Master ***
+ * This method validates the answer in au8Buffer and transfers its data
+ * to au16regs, as defined in its modbus_t query telegram.
+ *
+ * @return the same as poll()
+ * @ingroup loop
+ */
+int16_t Modbus::processAnswer() {
+  // transfer the frame from auBuffer
+  int16_t i16state = getRxBuffer();
+  if (i16state < 7) {
     u8state = COM_IDLE;
     u16errCnt++;
-    return i8state;
+    return i16state;
   }
 
   // validate message: id, CRC, FCT, exception
@@ -553,16 +1892,20 @@ int8_t Modbus::poll() {
 
   // process answer
   switch( au8Buffer[ FUNC ] ) {
+#if MODBUS_FUNCTIONS & (MODBUS_FC1 | MODBUS_FC2)
   case MB_FC_READ_COILS:
   case MB_FC_READ_DISCRETE_INPUT:
     // call get_FC1 to transfer the incoming message to au16regs buffer
     get_FC1( );
     break;
+#endif
+#if MODBUS_FUNCTIONS & (MODBUS_FC3 | MODBUS_FC4)
   case MB_FC_READ_INPUT_REGISTER:
   case MB_FC_READ_REGISTERS :
     // call get_FC3 to transfer the incoming message to au16regs buffer
     get_FC3( );
     break;
+#endif
   case MB_FC_WRITE_COIL:
   case MB_FC_WRITE_REGISTER :
   case MB_FC_WRITE_MULTIPLE_COILS:
@@ -573,43 +1916,23 @@ int8_t Modbus::poll() {
     break;
   }  
   u8state = COM_IDLE;
-  return u8BufferSize;
+  return i16state;
 }
 
 /**
  * @brief
  * *** Only for Modbus Slave ***
- * This method checks if there is any incoming query
- * Afterwards, it would shoot a validation routine plus a register query
- * Avoid any delay() function !!!!
+ * This method validates the query in au8Buffer against the register table
+ * and answers it.
  * After a successful frame between the Master and the Slave, the time-out timer is reset.
- * 
- * @param *regs  register table for communication exchange
- * @param u8size  size of the register table
- * @return 0 if no query, 1..4 if communication error, >4 if correct query processed
+ *
+ * @return the same as poll()
  * @ingroup loop
  */
-int8_t Modbus::poll( uint16_t *regs, uint8_t u8size ) {
-
-  au16regs = regs;
-  u8regsize = u8size;
-
-  // check if there is any incoming frame
-  uint8_t u8current = port->available();  
-  if (u8current == 0) return 0;
-
-  // check T35 after frame end or still no frame end
-  if (u8current != u8lastRec) {
-    u8lastRec = u8current;
-    u32time = millis() + T35;
-    return 0;
-  }
-  if (millis() < u32time) return 0;
-
-  u8lastRec = 0;
-  int8_t i8state = getRxBuffer();
-  u8lastError = i8state;
-  if (i8state < 7) return i8state;  
+int16_t Modbus::processRequest() {
+  int16_t i16state = getRxBuffer();
+  u8lastError = i16state;
+  if (i16state < 7) return i16state;  
 
   // check slave id
   if (au8Buffer[ ID ] != u8id) return 0;
@@ -625,72 +1948,207 @@ int8_t Modbus::poll( uint16_t *regs, uint8_t u8size ) {
     return u8exception;
   }
 
-  u32timeOut = millis() + long(u16timeOut);
+  u32timeOut = halMillis() + long(u16timeOut);
   u8lastError = 0;
   
-  // process message
+  // process message, only enabled function codes get past validateRequest()
   switch( au8Buffer[ FUNC ] ) {
+#if MODBUS_FUNCTIONS & (MODBUS_FC1 | MODBUS_FC2)
   case MB_FC_READ_COILS:
+    return process_FC1( MB_COILS );
+    break;
   case MB_FC_READ_DISCRETE_INPUT:
-    return process_FC1( regs, u8size );
+    return process_FC1( MB_DISCRETE_INPUTS );
     break;
+#endif
+#if MODBUS_FUNCTIONS & (MODBUS_FC3 | MODBUS_FC4)
   case MB_FC_READ_INPUT_REGISTER:
+    return process_FC3( MB_INPUT_REGISTERS );
+    break;
   case MB_FC_READ_REGISTERS :
-    return process_FC3( regs, u8size );
+    return process_FC3( MB_HOLDING_REGISTERS );
     break;
+#endif
+#if MODBUS_FUNCTIONS & MODBUS_FC5
   case MB_FC_WRITE_COIL:
-    return process_FC5( regs, u8size );
+    return process_FC5();
     break;
+#endif
+#if MODBUS_FUNCTIONS & MODBUS_FC6
   case MB_FC_WRITE_REGISTER :
-    return process_FC6( regs, u8size );
+    return process_FC6();
     break;
+#endif
+#if MODBUS_FUNCTIONS & MODBUS_FC15
   case MB_FC_WRITE_MULTIPLE_COILS:
-    return process_FC15( regs, u8size );
+    return process_FC15();
     break;
+#endif
+#if MODBUS_FUNCTIONS & MODBUS_FC16
   case MB_FC_WRITE_MULTIPLE_REGISTERS :
-    return process_FC16( regs, u8size );
+    return process_FC16();
     break;
+#endif
   default:
     break;
   }
-  return i8state;
+  return i16state;
 }
 
-/* _____PRIVATE FUNCTIONS_____________________________________________________ */
-
 void Modbus::init(uint8_t u8id, uint8_t u8serno, uint8_t u8txenpin) {
   this->u8id = u8id;
   this->u8serno = (u8serno > 3) ? 0 : u8serno;
   this->u8txenpin = u8txenpin;
   this->u16timeOut = 1000;
+  this->u8state = COM_IDLE;
+  this->txCallback = NULL;
+#if MODBUS_RESPONSE_CACHE > 0
+  for (uint8_t i = 0; i < MODBUS_RESPONSE_CACHE; i++) aCache[ i ].u8length = 0;
+  u8cacheNext = 0;
+  u16version = 0;
+  u16cacheHits = u16cacheMisses = 0;
+#endif
+  for (uint8_t i = 0; i < MB_TABLES_NO; i++) {
+    apSegments[ i ] = NULL;
+    setTable( i, NULL, 0 );
+  }
+  this->u8dirtyTables = 0;
+  this->u8frontTables = 0;
+  this->u8readTable = MB_TABLES_NO;
+  this->pWriteHooks = NULL;
+  this->u8writeHooks = 0;
+  this->pReadHooks = NULL;
+  this->u8readHooks = 0;
+#if MODBUS_SHARED_BUFFERS > 0
+  this->au8Buffer = NULL;
+#endif
+#if MODBUS_RX_RING > 0
+  u8ringHead = u8ringTail = 0;
+#endif
 }
 
 /**
  * @brief
- * This method moves Serial buffer data to the Modbus au8Buffer.
+ * This method runs one received byte through the receive state machine.
+ * The byte is stored in au8Buffer and added to the running CRC,
+ * writes never go beyond MAX_BUFFER. The frame is complete as soon as the
+ * length announced by its header is in. Oversized and bad frames are
+ * dropped until T3.5 of silence.
  *
- * @return buffer size if OK, ERR_BUFF_OVERFLOW if u8BufferSize >= MAX_BUFFER
+ * @param u8byte  received byte
+ * @param u32now  arrival time of the byte in us
  * @ingroup buffer
  */
-int8_t Modbus::getRxBuffer() {
-  boolean bBuffOverflow = false;
+void Modbus::rxByte( uint8_t u8byte, uint32_t u32now ) {
+  uint16_t u16length;
+
+  // T3.5 of silence ends the discarding of a bad frame
+  if ((u8rxState == RX_DISCARD) && ((unsigned long)(u32now - u32time) >= u32T35)) {
+    u8rxState = RX_IDLE;
+  }
+  u32time = u32now;
+
+  switch( u8rxState ) {
+  case RX_IDLE:
+    if (!takeBuffer()) {
+      // no shared buffer left, drop the whole frame
+      u8rxState = RX_DISCARD;
+      u16errCnt++;
+      break;
+    }
+    u16BufferSize = 0;
+    u16RxCRC = 0xFFFF;
+    u8rxState = RX_RECEIVING;
+    // fall through - the first byte is stored as any other one
+  case RX_RECEIVING:
+    if (u16BufferSize >= MAX_BUFFER) {
+      u8rxState = RX_OVERFLOW;
+      break;
+    }
+    au8Buffer[ u16BufferSize ] = u8byte;
+    u16BufferSize ++;
+    u16RxCRC = crc16Update( u16RxCRC, u8byte );
 
-  if (u8txenpin > 1) digitalWrite( u8txenpin, LOW );
+    u16length = frameLength();
+    if ((u16length != 0) && (u16BufferSize >= u16length)) u8rxState = RX_COMPLETE;
+    break;
+  default:
+    // RX_COMPLETE, RX_OVERFLOW, RX_DISCARD: the byte is dropped
+    break;
+  }
+}
 
-  u8BufferSize = 0;
-  while ( port->available() ) {
-    au8Buffer[ u8BufferSize ] = port->read();
-    u8BufferSize ++;
+/**
+ * @brief
+ * This method predicts the total length of the frame being received
+ * from its header: a request for a slave, an answer for the master.
+ *
+ * @return frame length including CRC, 0 if not known (yet)
+ * @ingroup buffer
+ */
+uint16_t Modbus::frameLength() {
+  if (u16BufferSize <= FUNC) return 0;
+
+  if (u8id == 0) {
+    // answer to the master
+    if ((au8Buffer[ FUNC ] & 0x80) != 0) return EXCEPTION_SIZE + CHECKSUM_SIZE;
+
+    switch( au8Buffer[ FUNC ] ) {
+    case MB_FC_READ_COILS:
+    case MB_FC_READ_DISCRETE_INPUT:
+    case MB_FC_READ_REGISTERS:
+    case MB_FC_READ_INPUT_REGISTER:
+      if (u16BufferSize <= 2) return 0;
+      return 3 + (uint16_t) au8Buffer[ 2 ] + CHECKSUM_SIZE;
+    case MB_FC_WRITE_COIL:
+    case MB_FC_WRITE_REGISTER:
+    case MB_FC_WRITE_MULTIPLE_COILS:
+    case MB_FC_WRITE_MULTIPLE_REGISTERS:
+      return RESPONSE_SIZE + CHECKSUM_SIZE;
+    }
+    return 0;
+  }
 
-    if (u8BufferSize >= MAX_BUFFER) bBuffOverflow = true;
+  // request to the slave
+  switch( au8Buffer[ FUNC ] ) {
+  case MB_FC_READ_COILS:
+  case MB_FC_READ_DISCRETE_INPUT:
+  case MB_FC_READ_REGISTERS:
+  case MB_FC_READ_INPUT_REGISTER:
+  case MB_FC_WRITE_COIL:
+  case MB_FC_WRITE_REGISTER:
+    return RESPONSE_SIZE + CHECKSUM_SIZE;
+  case MB_FC_WRITE_MULTIPLE_COILS:
+  case MB_FC_WRITE_MULTIPLE_REGISTERS:
+    if (u16BufferSize <= BYTE_CNT) return 0;
+    return BYTE_CNT + 1 + (uint16_t) au8Buffer[ BYTE_CNT ] + CHECKSUM_SIZE;
   }
+  return 0;
+}
+
+/**
+ * @brief
+ * This method takes the complete frame in the Modbus au8Buffer,
+ * so that the next incoming byte starts a new one.
+ * After a CRC error the receiver drops bytes until T3.5 of silence,
+ * in case the frame was cut at the wrong place.
+ *
+ * @return buffer size if OK, ERR_BUFF_OVERFLOW if the frame did not fit in MAX_BUFFER
+ * @ingroup buffer
+ */
+int16_t Modbus::getRxBuffer() {
+  if (u8txenpin > 1) halPinWrite( port, u8txenpin, LOW );
+
   u16InCnt++;
 
-  if (bBuffOverflow) {
+  if (u8rxState == RX_OVERFLOW) {
+    u8rxState = RX_IDLE;
+    u16BufferSize = 0;
     u16errCnt++;
     return ERR_BUFF_OVERFLOW;
   }
-  return u8BufferSize;
+  u8rxState = (u16RxCRC == 0) ? RX_IDLE : RX_DISCARD;
+  return u16BufferSize;
 }
 
 /**
@@ -698,121 +2156,211 @@ int8_t Modbus::getRxBuffer() {
  * This method transmits au8Buffer to Serial line.
  * Only if u8txenpin != 0, there is a flow handling in order to keep
  * the RS485 transceiver in output state as long as the message is being sent.
- * This is done with UCSRxA register.
- * The CRC is appended to the buffer before starting to send it.
+ * By default it waits for the UCSRxA TXC flag.
+ * With MODBUS_TX_ISR the frame is queued and the method returns at once:
+ * the state is COM_SENDING until the USART TX complete interrupt returns
+ * the transceiver to receive mode (see endTx()).
+ * The CRC is appended to the message while it is sent.
  *
  * @param nothing
  * @return nothing
  * @ingroup buffer
  */
 void Modbus::sendTxBuffer() {
-  uint8_t i = 0;
-
-  // append CRC to message
-  uint16_t u16crc = calcCRC( u8BufferSize );
-  au8Buffer[ u8BufferSize ] = u16crc >> 8;
-  u8BufferSize++;
-  au8Buffer[ u8BufferSize ] = u16crc & 0x00ff;
-  u8BufferSize++;
+  txBegin();
+  txWrite( au8Buffer, u16BufferSize );
+  txEnd();
+}
 
+/**
+ * @brief
+ * This method starts a frame: the RS485 transceiver goes to transmit mode
+ * and the CRC of the outgoing bytes is reset.
+ * The frame is then written with txWrite() and closed with txEnd().
+ *
+ * @ingroup buffer
+ */
+void Modbus::txBegin() {
   // set RS485 transceiver to transmit mode
   if (u8txenpin > 1) {
-    switch( u8serno ) {
-#if defined(UBRR1H)
-    case 1:
-      UCSR1A=UCSR1A |(1 << TXC1);
-      break;
-#endif
+    halTxStart( u8serno );
+    halPinWrite( port, u8txenpin, HIGH );
+  }
+  u8state = COM_SENDING;
+  u16TxCRC = 0xFFFF;
+}
 
-#if defined(UBRR2H)
-    case 2:
-      UCSR2A=UCSR2A |(1 << TXC2);
-      break;
-#endif
+/**
+ * @brief
+ * This method sends part of a frame straight to the serial line
+ * and adds it to the running CRC.
+ *
+ * @param pu8data  first byte to send
+ * @param u16length  number of bytes to send
+ * @ingroup buffer
+ */
+void Modbus::txWrite( const uint8_t *pu8data, uint16_t u16length ) {
+  u16TxCRC = crc16Block( u16TxCRC, pu8data, u16length );
+  port->write( pu8data, u16length );
+}
 
-#if defined(UBRR3H)
-    case 3:
-      UCSR3A=UCSR3A |(1 << TXC3);
-      break;
-#endif
-    case 0:
-    default:
-      UCSR0A=UCSR0A |(1 << TXC0);
-      break;
-    }
-    digitalWrite( u8txenpin, HIGH );
-  }
+/**
+ * @brief
+ * This method appends the CRC, closes the frame and waits for
+ * it to leave the wire as explained in sendTxBuffer().
+ *
+ * @ingroup buffer
+ */
+void Modbus::txEnd() {
+  // append CRC to message, low byte first
+  uint8_t au8crc[ CHECKSUM_SIZE ] = { lowByte( u16TxCRC ), highByte( u16TxCRC ) };
+  port->write( au8crc, CHECKSUM_SIZE );
+
+  u16BufferSize = 0;
+  releaseBuffer();
+  u8rxState = RX_IDLE;
 
-  // transfer buffer to serial line
-  port->write( au8Buffer, u8BufferSize );
+  // set time-out for master
+  u32timeOut = halMillis() + (unsigned long) u16timeOut;
+
+  // increase message counter
+  u16OutCnt++;
 
+  if (u8txenpin <= 1) {
+    // nothing to release, the serial driver sends the rest
+    endTx();
+    return;
+  }
+
+#if defined(MODBUS_NO_TX_ISR)
   // keep RS485 transceiver in transmit mode as long as sending
-  if (u8txenpin > 1) {
-    switch( u8serno ) {
-#if defined(UBRR1H)
-    case 1:
-      while (!(UCSR1A & (1 << TXC1)));
-      break;
+  halTxWait( port, u8serno );
+  endTx();
+#else
+  // let the TX complete interrupt return RS485 transceiver to receive mode
+  apTxOwner[ u8serno ] = this;
+  halTxInterrupt( u8serno, true );
 #endif
+}
 
-#if defined(UBRR2H)
-    case 2:
-      while (!(UCSR2A & (1 << TXC2)));
+/**
+ * @brief
+ * This method ends a transmission: the RS485 transceiver goes back
+ * to receive mode, a master starts waiting for the answer.
+ *
+ * @ingroup buffer
+ */
+void Modbus::endTx() {
+  // return RS485 transceiver to receive mode
+  if (u8txenpin > 1) halPinWrite( port, u8txenpin, LOW );
+
+  u8state = (u8id == 0) ? COM_WAITING : COM_IDLE;
+  if (txCallback != NULL) txCallback();
+}
+
+/**
+ * @brief
+ * This method borrows a frame buffer from the shared pool
+ * when MODBUS_SHARED_BUFFERS is set, otherwise there is nothing to do.
+ *
+ * @return TRUE if au8Buffer can be used
+ * @ingroup buffer
+ */
+boolean Modbus::takeBuffer() {
+#if MODBUS_SHARED_BUFFERS > 0
+  if (au8Buffer != NULL) return true;
+
+  // the pool is also used from interrupts through feedByte()
+  uint8_t u8sreg = halLock();
+  for (uint8_t i = 0; i < MODBUS_SHARED_BUFFERS; i++) {
+    if ((u8PoolUsed & (1 << i)) == 0) {
+      u8PoolUsed |= (1 << i);
+      au8Buffer = au8Pool[ i ];
       break;
+    }
+  }
+  halUnlock( u8sreg );
+  return (au8Buffer != NULL);
+#else
+  return true;
 #endif
+}
 
-#if defined(UBRR3H)
-    case 3:
-      while (!(UCSR3A & (1 << TXC3)));
-      break;
+/**
+ * @brief
+ * This method gives the frame buffer back to the shared pool.
+ *
+ * @ingroup buffer
+ */
+void Modbus::releaseBuffer() {
+#if MODBUS_SHARED_BUFFERS > 0
+  if (au8Buffer == NULL) return;
+
+  uint8_t u8sreg = halLock();
+  u8PoolUsed &= ~(1 << ((au8Buffer - au8Pool[ 0 ]) / MAX_BUFFER));
+  au8Buffer = NULL;
+  halUnlock( u8sreg );
 #endif
-    case 0:
-    default:
-      while (!(UCSR0A & (1 << TXC0)));
-      break;
-    }
+}
 
-    // return RS485 transceiver to receive mode
-    digitalWrite( u8txenpin, LOW );
+/**
+ * @brief
+ * This method looks for the segment of a table holding an address,
+ * with a binary search on the sorted segments
+ *
+ * @param u8table  MB_TABLES
+ * @param u16add  coil or register address
+ * @return segment holding u16add, NULL if none
+ * @ingroup buffer
+ */
+const modbus_segment_t *Modbus::findSegment( uint8_t u8table, uint16_t u16add ) {
+  const modbus_segment_t *segments = apSegments[ u8table ];
+  uint8_t u8low = 0, u8high = au8segments[ u8table ], u8mid;
+
+  // find the last segment starting at or below u16add
+  while (u8low < u8high) {
+    u8mid = (u8low + u8high) / 2;
+    if (segments[ u8mid ].u16start <= u16add) u8low = u8mid + 1;
+    else u8high = u8mid;
   }
-  port->flush();
-  u8BufferSize = 0;
+  if (u8low == 0) return NULL;
 
-  // set time-out for master
-  u32timeOut = millis() + (unsigned long) u16timeOut;
-
-  // increase message counter
-  u16OutCnt++;
+  const modbus_segment_t *segment = &segments[ u8low - 1 ];
+  if ((uint16_t)(u16add - segment->u16start) >= segment->u16length) return NULL;
+  return segment;
 }
 
 /**
  * @brief
- * This method calculates CRC
+ * This method checks that a range of a table is published,
+ * through one segment or adjacent ones, and writable if needed
  *
- * @return uint16_t calculated CRC value for the message
+ * @param u8table  MB_TABLES
+ * @param u16add  first coil or register
+ * @param u16no  number of coils or registers
+ * @param bWrite  TRUE if the request writes the range
+ * @return 0 if OK, EXC_ADDR_RANGE otherwise
  * @ingroup buffer
  */
-uint16_t Modbus::calcCRC(uint8_t u8length) {
-  unsigned int temp, temp2, flag;
-  temp = 0xFFFF;
-  for (unsigned char i = 0; i < u8length; i++) {
-    temp = temp ^ au8Buffer[i];
-    for (unsigned char j = 1; j <= 8; j++) {
-      flag = temp & 0x0001;
-      temp >>=1;
-      if (flag)
-        temp ^= 0xA001;
-    }
+uint8_t Modbus::validateRange( uint8_t u8table, uint16_t u16add, uint16_t u16no, boolean bWrite ) {
+  const modbus_segment_t *segment = findSegment( u8table, u16add );
+  const modbus_segment_t *last = apSegments[ u8table ] + au8segments[ u8table ] - 1;
+  uint32_t u32end = (uint32_t) u16add + u16no;
+  uint32_t u32segEnd;
+
+  if (segment == NULL) return EXC_ADDR_RANGE;
+  for (;;) {
+    if (bWrite && (segment->u8flags & (SEG_READONLY | SEG_FLASH | SEG_DOUBLE))) return EXC_ADDR_RANGE;
+    u32segEnd = (uint32_t) segment->u16start + segment->u16length;
+    if (u32end <= u32segEnd) return 0;
+
+    // the range goes on in the next segment only if there is no gap
+    if ((segment == last) || (segment[ 1 ].u16start != u32segEnd)) return EXC_ADDR_RANGE;
+    segment++;
   }
-  // Reverse byte order. 
-  temp2 = temp >> 8;
-  temp = (temp << 8) | temp2;
-  temp &= 0xFFFF; 
-  // the returned value is already swapped
-  // crcLo byte is first & crcHi byte is last
-  return temp; 
 }
 
+
 /**
  * @brief
  * This method validates slave incoming messages
@@ -821,58 +2369,65 @@ uint16_t Modbus::calcCRC(uint8_t u8length) {
  * @ingroup buffer
  */
 uint8_t Modbus::validateRequest() {
-  // check message crc vs calculated crc
-  uint16_t u16MsgCRC = 
-    ((au8Buffer[u8BufferSize - 2] << 8) 
-    | au8Buffer[u8BufferSize - 1]); // combine the crc Low & High bytes
-  if ( calcCRC( u8BufferSize-2 ) != u16MsgCRC ) {
+  // check message crc: the remainder over data plus crc is 0 for a good frame
+  if ( u16RxCRC != 0 ) {
     u16errCnt ++;
     return NO_REPLY;
   }
 
   // check fct code
-  boolean isSupported = false;
-  for (uint8_t i = 0; i< sizeof( fctsupported ); i++) {
-    if (fctsupported[i] == au8Buffer[FUNC]) {
-      isSupported = 1;
-      break;
-    }
-  }
-  if (!isSupported) {
+  if (!fctSupported( au8Buffer[ FUNC ] )) {
     u16errCnt ++;
     return EXC_FUNC_CODE;
   }
 
-  // check start address & nb range
-  uint16_t u16regs = 0;
-  uint8_t u8regs;
+  // check length: a silence may close a frame shorter than its header says,
+  // the handlers must not read past the bytes received
+  if (u16BufferSize != frameLength()) {
+    u16errCnt ++;
+    return EXC_REGS_QUANT;
+  }
+
+  // check quantity: the answer must fit in au8Buffer, register reads
+  // are streamed to the port and only keep the 125 registers limit,
+  // the data of a write must match its byte counter
+  uint16_t u16add = word( au8Buffer[ ADD_HI ], au8Buffer[ ADD_LO ]);
+  uint16_t u16no = word( au8Buffer[ NB_HI ], au8Buffer[ NB_LO ]);
   switch ( au8Buffer[ FUNC ] ) {
   case MB_FC_READ_COILS:
   case MB_FC_READ_DISCRETE_INPUT:
+    if ((u16no == 0) || (3 + (u16no + 7) / 8 + CHECKSUM_SIZE > MAX_BUFFER)) return EXC_REGS_QUANT;
+    break;
+  case MB_FC_READ_REGISTERS :
+  case MB_FC_READ_INPUT_REGISTER :
+    if ((u16no == 0) || (u16no > 125)) return EXC_REGS_QUANT;
+    break;
   case MB_FC_WRITE_MULTIPLE_COILS:
-    u16regs = word( au8Buffer[ ADD_HI ], au8Buffer[ ADD_LO ]) / 16;
-    u16regs += word( au8Buffer[ NB_HI ], au8Buffer[ NB_LO ]) /16;
-    u8regs = (uint8_t) u16regs;
-    if (u8regs > u8regsize) return EXC_ADDR_RANGE;
+    if ((u16no == 0) || (au8Buffer[ BYTE_CNT ] != (u16no + 7) / 8)) return EXC_REGS_QUANT;
     break;
-  case MB_FC_WRITE_COIL:
-    u16regs = word( au8Buffer[ ADD_HI ], au8Buffer[ ADD_LO ]) / 16;
-    u8regs = (uint8_t) u16regs;
-    if (u8regs > u8regsize) return EXC_ADDR_RANGE;
-    break;  
-  case MB_FC_WRITE_REGISTER :
-    u16regs = word( au8Buffer[ ADD_HI ], au8Buffer[ ADD_LO ]);
-    u8regs = (uint8_t) u16regs;
-    if (u8regs > u8regsize) return EXC_ADDR_RANGE;
+  case MB_FC_WRITE_MULTIPLE_REGISTERS :
+    if ((u16no == 0) || (au8Buffer[ BYTE_CNT ] != u16no * 2)) return EXC_REGS_QUANT;
     break;
+  }
+
+  // check start address & nb range in the table of the function
+  switch ( au8Buffer[ FUNC ] ) {
+  case MB_FC_READ_COILS:
+    return validateRange( MB_COILS, u16add, u16no, false );
+  case MB_FC_READ_DISCRETE_INPUT:
+    return validateRange( MB_DISCRETE_INPUTS, u16add, u16no, false );
   case MB_FC_READ_REGISTERS :
+    return validateRange( MB_HOLDING_REGISTERS, u16add, u16no, false );
   case MB_FC_READ_INPUT_REGISTER :
+    return validateRange( MB_INPUT_REGISTERS, u16add, u16no, false );
+  case MB_FC_WRITE_COIL:
+    return validateRange( MB_COILS, u16add, 1, true );
+  case MB_FC_WRITE_MULTIPLE_COILS:
+    return validateRange( MB_COILS, u16add, u16no, true );
+  case MB_FC_WRITE_REGISTER :
+    return validateRange( MB_HOLDING_REGISTERS, u16add, 1, true );
   case MB_FC_WRITE_MULTIPLE_REGISTERS :
-    u16regs = word( au8Buffer[ ADD_HI ], au8Buffer[ ADD_LO ]);
-    u16regs += word( au8Buffer[ NB_HI ], au8Buffer[ NB_LO ]);
-    u8regs = (uint8_t) u16regs;
-    if (u8regs > u8regsize) return EXC_ADDR_RANGE;    
-    break;
+    return validateRange( MB_HOLDING_REGISTERS, u16add, u16no, true );
   }
   return 0; // OK, no exception code thrown
 }
@@ -885,11 +2440,8 @@ uint8_t Modbus::validateRequest() {
  * @ingroup buffer
  */
 uint8_t Modbus::validateAnswer() {
-  // check message crc vs calculated crc
-  uint16_t u16MsgCRC = 
-    ((au8Buffer[u8BufferSize - 2] << 8) 
-    | au8Buffer[u8BufferSize - 1]); // combine the crc Low & High bytes
-  if ( calcCRC( u8BufferSize-2 ) != u16MsgCRC ) {
+  // check message crc: the remainder over data plus crc is 0 for a good frame
+  if ( u16RxCRC != 0 ) {
     u16errCnt ++;
     return NO_REPLY;
   }
@@ -901,18 +2453,17 @@ uint8_t Modbus::validateAnswer() {
   }
 
   // check fct code
-  boolean isSupported = false;
-  for (uint8_t i = 0; i< sizeof( fctsupported ); i++) {
-    if (fctsupported[i] == au8Buffer[FUNC]) {
-      isSupported = 1;
-      break;
-    }
-  }
-  if (!isSupported) {
+  if (!fctSupported( au8Buffer[ FUNC ] )) {
     u16errCnt ++;
     return EXC_FUNC_CODE;
   }
 
+  // check length: get_FC3() trusts the byte counter of the answer
+  if (u16BufferSize != frameLength()) {
+    u16errCnt ++;
+    return NO_REPLY;
+  }
+
   return 0; // OK, no exception code thrown
 }
 
@@ -928,9 +2479,10 @@ void Modbus::buildException( uint8_t u8exception ) {
   au8Buffer[ ID ]      = u8id;
   au8Buffer[ FUNC ]    = u8func + 0x80;
   au8Buffer[ 2 ]       = u8exception;
-  u8BufferSize         = EXCEPTION_SIZE;
+  u16BufferSize         = EXCEPTION_SIZE;
 }
 
+#if MODBUS_FUNCTIONS & (MODBUS_FC1 | MODBUS_FC2)
 /**
  * This method processes functions 1 & 2 (for master)
  * This method puts the slave answer into master data buffer 
@@ -949,7 +2501,9 @@ void Modbus::get_FC1() {
   //    u8byte += 2;
   //  }
 }
+#endif
 
+#if MODBUS_FUNCTIONS & (MODBUS_FC3 | MODBUS_FC4)
 /**
  * This method processes functions 3 & 4 (for master)
  * This method puts the slave answer into master data buffer 
@@ -957,238 +2511,357 @@ void Modbus::get_FC1() {
  * @ingroup register
  */
 void Modbus::get_FC3() {
-  uint8_t u8byte, i;
-  u8byte = 3;
-
-  for (i=0; i< au8Buffer[ 2 ] /2; i++) {
-    au16regs[ i ] = word( 
-    au8Buffer[ u8byte ],
-    au8Buffer[ u8byte +1 ]);
-    u8byte += 2;
-  }
+  // validateAnswer() checked au8Buffer[ 2 ] against the bytes received
+  decodeRegisters( au16regs, &au8Buffer[ 3 ], au8Buffer[ 2 ] / 2 );
 }
+#endif
 
+#if MODBUS_FUNCTIONS & (MODBUS_FC1 | MODBUS_FC2)
 /**
  * @brief
  * This method processes functions 1 & 2
  * This method reads a bit array and transfers it to the master
  *
- * @return u8BufferSize Response to master length
+ * @return u16BufferSize Response to master length
  * @ingroup discrete
  */
-int8_t Modbus::process_FC1( uint16_t *regs, uint8_t u8size ) {
-  uint8_t u8currentRegister, u8currentBit, u8bytesno, u8bitsno;
-  uint8_t u8CopyBufferSize;
-  uint16_t u16currentCoil, u16coil;
+int16_t Modbus::process_FC1( uint8_t u8table ) {
+  uint8_t u8bytesno;
+  uint16_t u16CopyBufferSize;
+  uint16_t u16currentCoil, u16coil, u16chunk;
 
   // get the first and last coil from the message
   uint16_t u16StartCoil = word( au8Buffer[ ADD_HI ], au8Buffer[ ADD_LO ] );
   uint16_t u16Coilno = word( au8Buffer[ NB_HI ], au8Buffer[ NB_LO ] );
+  const modbus_segment_t *segment = findSegment( u8table, u16StartCoil );
+  uint8_t u8image;
 
-  // put the number of bytes in the outcoming message
-  u8bytesno = (uint8_t) (u16Coilno / 8);
-  if (u16Coilno % 8 != 0) u8bytesno ++;
-  au8Buffer[ ADD_HI ]  = u8bytesno;
-  u8BufferSize         = ADD_LO;
-
-  // read each coil from the register map and put its value inside the outcoming message
-  u8bitsno = 0;
-
-  for (u16currentCoil = 0; u16currentCoil < u16Coilno; u16currentCoil++) {
-    u16coil = u16StartCoil + u16currentCoil;
-    u8currentRegister = (uint8_t) (u16coil / 16);
-    u8currentBit = (uint8_t) (u16coil % 16);
-
-    bitWrite(
-    au8Buffer[ u8BufferSize ],
-    u8bitsno,
-    bitRead( regs[ u8currentRegister ], u8currentBit ) );
-    u8bitsno ++;
+  runReadHooks( u8table, u16StartCoil, u16Coilno );
+  u8image = latchImage( u8table );
 
-    if (u8bitsno > 7) {
-      u8bitsno = 0;
-      u8BufferSize++;
-    }
+  // put the number of bytes in the outcoming message,
+  // the unused bits of the last byte stay 0
+  u8bytesno = (uint8_t) ((u16Coilno + 7) / 8);
+  au8Buffer[ ADD_HI ]  = u8bytesno;
+  u16BufferSize         = ADD_LO;
+  memset( &au8Buffer[ u16BufferSize ], 0, u8bytesno );
+
+  // copy the coils of each segment to the outcoming message,
+  // validateRequest() checked that the segments follow each other
+  u16coil = u16StartCoil - segment->u16start;
+  for (u16currentCoil = 0; u16currentCoil < u16Coilno; u16currentCoil += u16chunk) {
+    u16chunk = segment->u16length - u16coil;
+    if (u16chunk > u16Coilno - u16currentCoil) u16chunk = u16Coilno - u16currentCoil;
+    bitCopy( &au8Buffer[ u16BufferSize ], u16currentCoil,
+      segmentImage( segment, u8table, u8image ), u16coil, u16chunk, segment->u8flags & SEG_FLASH );
+    segment++;
+    u16coil = 0;
   }
+  u8readTable = MB_TABLES_NO;
 
   // send outcoming message
-  if (u16Coilno % 8 != 0) u8BufferSize ++;
-  u8CopyBufferSize = u8BufferSize +2;
+  u16BufferSize += u8bytesno;
+  u16CopyBufferSize = u16BufferSize +2;
   sendTxBuffer();
-  return u8CopyBufferSize;
+  return u16CopyBufferSize;
 }
+#endif
 
+#if MODBUS_FUNCTIONS & (MODBUS_FC3 | MODBUS_FC4)
 /**
  * @brief
  * This method processes functions 3 & 4
  * This method reads a word array and transfers it to the master
+ * The answer is streamed to the serial line with a running CRC,
+ * TX_CHUNK registers at a time, so it is not limited by MAX_BUFFER
+ * Registers of SEG_FLASH segments are read from PROGMEM,
+ * SEG_DOUBLE segments from the front image when the request starts
  *
- * @return u8BufferSize Response to master length
+ * @return u16BufferSize Response to master length
  * @ingroup register
  */
-int8_t Modbus::process_FC3( uint16_t *regs, uint8_t u8size ) {
+int16_t Modbus::process_FC3( uint8_t u8table ) {
+
+  uint16_t u16StartAdd = word( au8Buffer[ ADD_HI ], au8Buffer[ ADD_LO ] );
+  uint16_t u16regsno = word( au8Buffer[ NB_HI ], au8Buffer[ NB_LO ] );
+  const modbus_segment_t *segment = findSegment( u8table, u16StartAdd );
+  uint16_t u16reg = u16StartAdd - segment->u16start;
+  uint16_t u16chunk;
+  uint8_t au8chunk[ 2 * TX_CHUNK ];
+  uint16_t i, j;
+  uint8_t u8image;
+  boolean bHooked = runReadHooks( u8table, u16StartAdd, u16regsno );
+
+#if MODBUS_RESPONSE_CACHE > 0
+  // resend the answer kept for the same request and tables,
+  // otherwise encode it into the next entry if it fits
+  boolean bCacheable = !bHooked && isCacheable( segment, u16reg, u16regsno );
+  modbus_cache_t *entry = bCacheable ? findCache() : NULL;
+  uint16_t u16tables = u16version;
+  uint16_t u16cached = 0;
+
+  if (entry != NULL) {
+    u16cacheHits++;
+    releaseBuffer();
+    txBegin();
+    port->write( entry->au8answer, entry->u8length );
+    u16TxCRC = entry->u16crc;
+    txEnd();
+    return entry->u8length + CHECKSUM_SIZE;
+  }
+  if (bCacheable) {
+    u16cacheMisses++;
+    if (3 + u16regsno * 2 <= MODBUS_CACHE_BYTES) {
+      entry = &aCache[ u8cacheNext ];
+      u8cacheNext = (u8cacheNext + 1) % MODBUS_RESPONSE_CACHE;
+      entry->u8length = 0;
+      memcpy( entry->au8request, au8Buffer, sizeof( entry->au8request ) );
+    }
+  }
+#else
+  (void) bHooked;
+#endif
 
-  uint8_t u8StartAdd = word( au8Buffer[ ADD_HI ], au8Buffer[ ADD_LO ] );
-  uint8_t u8regsno = word( au8Buffer[ NB_HI ], au8Buffer[ NB_LO ] );
-  uint8_t u8CopyBufferSize;
-  uint8_t i;
+  // the whole answer comes from the snapshot published at this point
+  u8image = latchImage( u8table );
 
-  au8Buffer[ 2 ]       = u8regsno * 2;
-  u8BufferSize         = 3;
+  // the request is no longer needed: the answer goes straight to the port
+  au8chunk[ 0 ] = au8Buffer[ ID ];
+  au8chunk[ 1 ] = au8Buffer[ FUNC ];
+  au8chunk[ 2 ] = u16regsno * 2;
+  releaseBuffer();
 
-  for (i = u8StartAdd; i < u8StartAdd + u8regsno; i++) {
-    au8Buffer[ u8BufferSize ] = highByte(regs[i]);
-    u8BufferSize++;
-    au8Buffer[ u8BufferSize ] = lowByte(regs[i]);
-    u8BufferSize++;
+  txBegin();
+  txWrite( au8chunk, 3 );
+#if MODBUS_RESPONSE_CACHE > 0
+  if (entry != NULL) memcpy( entry->au8answer, au8chunk, 3 );
+  u16cached = 3;
+#endif
+  for (i = 0; i < u16regsno; i += u16chunk) {
+    // validateRequest() checked that the segments follow each other
+    if (u16reg >= segment->u16length) {
+      segment++;
+      u16reg = 0;
+    }
+    u16chunk = segment->u16length - u16reg;
+    if (u16chunk > u16regsno - i) u16chunk = u16regsno - i;
+    if (u16chunk > TX_CHUNK) u16chunk = TX_CHUNK;
+
+    if (segment->u8flags & SEG_FLASH) {
+      for (j = 0; j < u16chunk; j++) {
+        uint16_t u16value = segmentWord( segment, u16reg + j );
+        au8chunk[ 2 * j ] = highByte( u16value );
+        au8chunk[ 2 * j + 1 ] = lowByte( u16value );
+      }
+    }
+    else {
+      encodeRegisters( au8chunk, (const uint16_t *) segmentImage( segment, u8table, u8image ) + u16reg, u16chunk );
+    }
+    txWrite( au8chunk, u16chunk * 2 );
+#if MODBUS_RESPONSE_CACHE > 0
+    if (entry != NULL) memcpy( &entry->au8answer[ u16cached ], au8chunk, u16chunk * 2 );
+    u16cached += u16chunk * 2;
+#endif
+    u16reg += u16chunk;
   }
-  u8CopyBufferSize = u8BufferSize +2;
-  sendTxBuffer();
+  u8readTable = MB_TABLES_NO;
+#if MODBUS_RESPONSE_CACHE > 0
+  if (entry != NULL) {
+    // valid for the tables as they were when the request came in
+    entry->u16version = u16tables;
+    entry->u16crc = u16TxCRC;
+    entry->u8length = u16cached;
+  }
+#endif
+  txEnd();
 
-  return u8CopyBufferSize;
+  return 3 + u16regsno * 2 + CHECKSUM_SIZE;
 }
+#endif
 
+#if MODBUS_FUNCTIONS & MODBUS_FC5
 /**
  * @brief
  * This method processes function 5
  * This method writes a value assigned by the master to a single bit
  *
- * @return u8BufferSize Response to master length
+ * @return u16BufferSize Response to master length
  * @ingroup discrete
  */
-int8_t Modbus::process_FC5( uint16_t *regs, uint8_t u8size ) {
-  uint8_t u8currentRegister, u8currentBit;
-  uint8_t u8CopyBufferSize;
+int16_t Modbus::process_FC5() {
+  uint16_t u16CopyBufferSize;
   uint16_t u16coil = word( au8Buffer[ ADD_HI ], au8Buffer[ ADD_LO ] );
-
-  // point to the register and its bit
-  u8currentRegister = (uint8_t) (u16coil / 16);
-  u8currentBit = (uint8_t) (u16coil % 16);
+  const modbus_segment_t *segment = findSegment( MB_COILS, u16coil );
+  uint8_t *bits = (uint8_t *) segment->pData;
 
   // write to coil
+  u16coil -= segment->u16start;
   bitWrite(
-  regs[ u8currentRegister ],
-  u8currentBit,
+  bits[ u16coil >> 3 ],
+  u16coil & 7,
   au8Buffer[ NB_HI ] == 0xff );
-
+  markDirty( MB_COILS, segment, u16coil, 1 );
 
   // send answer to master
-  u8BufferSize = 6;
-  u8CopyBufferSize = u8BufferSize +2;
+  u16BufferSize = 6;
+  u16CopyBufferSize = u16BufferSize +2;
+  runWriteHooks( MB_COILS, u16coil + segment->u16start, 1 );
   sendTxBuffer();
 
-  return u8CopyBufferSize;
+  return u16CopyBufferSize;
 }
+#endif
 
+#if MODBUS_FUNCTIONS & MODBUS_FC6
 /**
  * @brief
  * This method processes function 6
  * This method writes a value assigned by the master to a single word
  *
- * @return u8BufferSize Response to master length
+ * @return u16BufferSize Response to master length
  * @ingroup register
  */
-int8_t Modbus::process_FC6( uint16_t *regs, uint8_t u8size ) {
+int16_t Modbus::process_FC6() {
 
-  uint8_t u8add = word( au8Buffer[ ADD_HI ], au8Buffer[ ADD_LO ] );
-  uint8_t u8CopyBufferSize;
+  uint16_t u16add = word( au8Buffer[ ADD_HI ], au8Buffer[ ADD_LO ] );
+  uint16_t u16CopyBufferSize;
   uint16_t u16val = word( au8Buffer[ NB_HI ], au8Buffer[ NB_LO ] );
+  const modbus_segment_t *segment = findSegment( MB_HOLDING_REGISTERS, u16add );
+  uint16_t *regs = (uint16_t *) segment->pData;
 
-  regs[ u8add ] = u16val;
+  regs[ u16add - segment->u16start ] = u16val;
+  markDirty( MB_HOLDING_REGISTERS, segment, u16add - segment->u16start, 1 );
 
   // keep the same header
-  u8BufferSize         = RESPONSE_SIZE;
+  u16BufferSize         = RESPONSE_SIZE;
 
-  u8CopyBufferSize = u8BufferSize +2;
+  u16CopyBufferSize = u16BufferSize +2;
+  runWriteHooks( MB_HOLDING_REGISTERS, u16add, 1 );
   sendTxBuffer();
 
-  return u8CopyBufferSize;
+  return u16CopyBufferSize;
 }
+#endif
 
+#if MODBUS_FUNCTIONS & MODBUS_FC15
 /**
  * @brief
  * This method processes function 15
  * This method writes a bit array assigned by the master
  *
- * @return u8BufferSize Response to master length
+ * @return u16BufferSize Response to master length
  * @ingroup discrete
  */
-int8_t Modbus::process_FC15( uint16_t *regs, uint8_t u8size ) {
-  uint8_t u8currentRegister, u8currentBit, u8frameByte, u8bitsno;
-  uint8_t u8CopyBufferSize;
-  uint16_t u16currentCoil, u16coil;
-  boolean bTemp;
+int16_t Modbus::process_FC15() {
+  uint16_t u16CopyBufferSize;
+  uint16_t u16currentCoil, u16coil, u16chunk;
 
   // get the first and last coil from the message
   uint16_t u16StartCoil = word( au8Buffer[ ADD_HI ], au8Buffer[ ADD_LO ] );
   uint16_t u16Coilno = word( au8Buffer[ NB_HI ], au8Buffer[ NB_LO ] );
-
-
-  // read each coil from the register map and put its value inside the outcoming message
-  u8bitsno = 0;
-  u8frameByte = 7;
-  for (u16currentCoil = 0; u16currentCoil < u16Coilno; u16currentCoil++) {
-
-    u16coil = u16StartCoil + u16currentCoil;
-    u8currentRegister = (uint8_t) (u16coil / 16);
-    u8currentBit = (uint8_t) (u16coil % 16);
-
-    bTemp = bitRead(
-    au8Buffer[ u8frameByte ],
-    u8bitsno );
-
-    bitWrite(
-    regs[ u8currentRegister ],
-    u8currentBit,
-    bTemp );
-
-    u8bitsno ++;
-
-    if (u8bitsno > 7) {
-      u8bitsno = 0;
-      u8frameByte++;
-    }
+  const modbus_segment_t *segment = findSegment( MB_COILS, u16StartCoil );
+
+  // copy the coils of the message to each segment,
+  // validateRequest() checked that the segments follow each other
+  u16coil = u16StartCoil - segment->u16start;
+  for (u16currentCoil = 0; u16currentCoil < u16Coilno; u16currentCoil += u16chunk) {
+    u16chunk = segment->u16length - u16coil;
+    if (u16chunk > u16Coilno - u16currentCoil) u16chunk = u16Coilno - u16currentCoil;
+    bitCopy( (uint8_t *) segment->pData, u16coil,
+      &au8Buffer[ BYTE_CNT + 1 ], u16currentCoil, u16chunk, false );
+    markDirty( MB_COILS, segment, u16coil, u16chunk );
+    segment++;
+    u16coil = 0;
   }
 
   // send outcoming message
   // it's just a copy of the incomping frame until 6th byte
-  u8BufferSize         = 6;
-  u8CopyBufferSize = u8BufferSize +2;
+  u16BufferSize         = 6;
+  u16CopyBufferSize = u16BufferSize +2;
+  runWriteHooks( MB_COILS, u16StartCoil, u16Coilno );
   sendTxBuffer();
-  return u8CopyBufferSize;
+  return u16CopyBufferSize;
 }
+#endif
 
+#if MODBUS_FUNCTIONS & MODBUS_FC16
 /**
  * @brief
  * This method processes function 16
  * This method writes a word array assigned by the master
  *
- * @return u8BufferSize Response to master length
+ * @return u16BufferSize Response to master length
  * @ingroup register
  */
-int8_t Modbus::process_FC16( uint16_t *regs, uint8_t u8size ) {
-  uint8_t u8func = au8Buffer[ FUNC ];  // get the original FUNC code
-  uint8_t u8StartAdd = au8Buffer[ ADD_HI ] << 8 | au8Buffer[ ADD_LO ];
-  uint8_t u8regsno = au8Buffer[ NB_HI ] << 8 | au8Buffer[ NB_LO ];
-  uint8_t u8CopyBufferSize;
-  uint8_t i;
-  uint16_t temp;
+int16_t Modbus::process_FC16() {
+  uint16_t u16StartAdd = au8Buffer[ ADD_HI ] << 8 | au8Buffer[ ADD_LO ];
+  uint16_t u16regsno = au8Buffer[ NB_HI ] << 8 | au8Buffer[ NB_LO ];
+  const modbus_segment_t *segment = findSegment( MB_HOLDING_REGISTERS, u16StartAdd );
+  uint16_t u16reg = u16StartAdd - segment->u16start;
+  uint16_t u16CopyBufferSize;
+  uint16_t u16chunk;
+  uint16_t i;
+
+  // write registers, validateRequest() checked that the segments follow each other
+  for (i = 0; i < u16regsno; i += u16chunk) {
+    u16chunk = segment->u16length - u16reg;
+    if (u16chunk > u16regsno - i) u16chunk = u16regsno - i;
+    decodeRegisters( (uint16_t *) segment->pData + u16reg, &au8Buffer[ (BYTE_CNT + 1) + i * 2 ], u16chunk );
+    markDirty( MB_HOLDING_REGISTERS, segment, u16reg, u16chunk );
+    segment++;
+    u16reg = 0;
+  }
 
   // build header
-  au8Buffer[ NB_HI ]   = 0;
-  au8Buffer[ NB_LO ]   = u8regsno;
-  u8BufferSize         = RESPONSE_SIZE;
-
-  // write registers
-  for (i = 0; i < u8regsno; i++) {
-    temp = word(
-    au8Buffer[ (BYTE_CNT + 1) + i * 2 ],
-    au8Buffer[ (BYTE_CNT + 2) + i * 2 ]);
+  au8Buffer[ NB_HI ]   = highByte( u16regsno );
+  au8Buffer[ NB_LO ]   = lowByte( u16regsno );
+  u16BufferSize         = RESPONSE_SIZE;
 
-    regs[ u8StartAdd + i ] = temp;
-  }
-  u8CopyBufferSize = u8BufferSize +2;
+  u16CopyBufferSize = u16BufferSize +2;
+  runWriteHooks( MB_HOLDING_REGISTERS, u16StartAdd, u16regsno );
   sendTxBuffer();
 
-  return u8CopyBufferSize;
+  return u16CopyBufferSize;
+}
+#endif
+
+Modbus *Modbus::apTxOwner[4];
+
+#if MODBUS_SHARED_BUFFERS > 0
+uint8_t Modbus::au8Pool[ MODBUS_SHARED_BUFFERS ][ MAX_BUFFER ];
+volatile uint8_t Modbus::u8PoolUsed;
+#endif
+
+#if !defined(MODBUS_NO_TX_ISR)
+#if defined(USART_TX_vect)
+ISR(USART_TX_vect) {
+  Modbus::txInterrupt( 0 );
+}
+#elif defined(USART0_TX_vect)
+ISR(USART0_TX_vect) {
+  Modbus::txInterrupt( 0 );
+}
+#endif
+
+#if defined(UBRR1H)
+ISR(USART1_TX_vect) {
+  Modbus::txInterrupt( 1 );
+}
+#endif
+
+#if defined(UBRR2H)
+ISR(USART2_TX_vect) {
+  Modbus::txInterrupt( 2 );
+}
+#endif
+
+#if defined(UBRR3H)
+ISR(USART3_TX_vect) {
+  Modbus::txInterrupt( 3 );
 }
+#endif
+#endif
+
+#endif // ARDUINO || MODBUS_IMPLEMENTATION
+
+#endif // MODBUSRTU_H
@@ -10,7 +10,7 @@
 //Задаём ведомому адрес, последовательный порт, выход управления TX
 Modbus slave(ID, 0, 0); 
 boolean led;
-int8_t state = 0;
+int16_t state = 0;
 unsigned long tempus;
 
 // массив данных modbus
@@ -0,0 +1,87 @@
+/**
+ * @file 		bench_bitcopy.cpp
+ *
+ * @description
+ *  Host benchmark of bitCopy(), the coil copy of FC1/FC2 and FC15,
+ *  against the former bit at a time loop with bitRead()/bitWrite(),
+ *  across start offsets and coil counts. Each combination is first
+ *  checked against the loop.
+ *
+ *  Usage: bench_bitcopy [rounds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "ModbusRtu.h"
+
+#define BITS_MAX  2000
+
+// the former coil loop of process_FC1(), one bit per step
+static void bitCopyReference( uint8_t *pu8dst, uint16_t u16dstBit,
+  const uint8_t *pu8src, uint16_t u16srcBit, uint16_t u16count ) {
+  for (uint16_t i = 0; i < u16count; i++) {
+    uint16_t u16src = u16srcBit + i, u16dst = u16dstBit + i;
+    bitWrite( pu8dst[ u16dst / 8 ], u16dst % 8, bitRead( pu8src[ u16src / 8 ], u16src % 8 ) );
+  }
+}
+
+static double seconds() {
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main( int argc, char **argv ) {
+  uint32_t u32rounds = (argc > 1) ? atoi( argv[1] ) : 2000;
+  static const uint16_t au16counts[] = { 8, 64, 256, 2000 };
+  static const uint8_t au8offsets[] = { 0, 1, 3, 7 };
+  static uint8_t au8src[ BITS_MAX / 8 + 2 ], au8dst[ BITS_MAX / 8 + 2 ], au8ref[ BITS_MAX / 8 + 2 ];
+  uint32_t u32sum = 0;
+
+  srand( 1 );
+  for (uint16_t i = 0; i < sizeof( au8src ); i++) au8src[i] = rand();
+
+  // same result as the loop for every offset pair, the bits around the range kept
+  for (uint16_t u16src = 0; u16src < 8; u16src++) {
+    for (uint16_t u16dst = 0; u16dst < 8; u16dst++) {
+      for (uint16_t u16count = 0; u16count <= 300; u16count++) {
+        memset( au8dst, 0x5a, sizeof( au8dst ) );
+        memset( au8ref, 0x5a, sizeof( au8ref ) );
+        bitCopy( au8dst, u16dst, au8src, u16src, u16count, false );
+        bitCopyReference( au8ref, u16dst, au8src, u16src, u16count );
+        if (memcmp( au8dst, au8ref, sizeof( au8dst ) ) != 0) {
+          printf( "mismatch: source bit %u, destination bit %u, %u bits\n", u16src, u16dst, u16count );
+          return 1;
+        }
+      }
+    }
+  }
+
+  printf( "coils  offset  reference ns  bitCopy ns  speedup\n" );
+  for (uint8_t c = 0; c < sizeof( au16counts ) / sizeof( au16counts[0] ); c++) {
+    for (uint8_t o = 0; o < sizeof( au8offsets ); o++) {
+      uint16_t u16count = au16counts[c];
+      uint8_t u8offset = au8offsets[o];
+      // a read from a segment starting at u8offset into the frame
+      double dStart = seconds();
+      for (uint32_t r = 0; r < u32rounds; r++) {
+        bitCopyReference( au8ref, 0, au8src, u8offset, u16count );
+        u32sum += au8ref[ r % (u16count / 8 + 1) ];
+      }
+      double dReference = (seconds() - dStart) / u32rounds;
+
+      dStart = seconds();
+      for (uint32_t r = 0; r < u32rounds; r++) {
+        bitCopy( au8dst, 0, au8src, u8offset, u16count, false );
+        u32sum += au8dst[ r % (u16count / 8 + 1) ];
+      }
+      double dCopy = (seconds() - dStart) / u32rounds;
+
+      printf( "%5u  %6u  %12.1f  %10.1f  %6.1fx\n", u16count, u8offset,
+        dReference * 1e9, dCopy * 1e9, dReference / dCopy );
+    }
+  }
+  // keep the results alive
+  return (u32sum == 1) ? 2 : 0;
+}
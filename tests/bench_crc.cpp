@@ -0,0 +1,122 @@
+/**
+ * @file 		bench_crc.cpp
+ *
+ * @description
+ *  Host benchmark of the CRC-16/Modbus engine selected by MODBUS_CRC,
+ *  against the bit loop of the former Modbus::calcCRC().
+ *  CMakeLists.txt builds it once per engine, each run checks that the
+ *  engine gives the same CRC as the loop over random frames.
+ *
+ *  Usage: bench_crc_<engine> [megabytes]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "ModbusRtu.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_CYCLES  1
+#else
+#define BENCH_CYCLES  0
+#endif
+
+static const char *engineName() {
+  switch( MODBUS_CRC ) {
+  case MODBUS_CRC_BITWISE: return "bitwise";
+  case MODBUS_CRC_NIBBLE: return "nibble";
+  case MODBUS_CRC_TABLE: return "table";
+  case MODBUS_CRC_SLICE8: return "slice8";
+  }
+  return "?";
+}
+
+// the loop of the former Modbus::calcCRC(), without its final byte swap
+static uint16_t crcReference( const uint8_t *pu8data, uint16_t u16length ) {
+  unsigned int temp = 0xFFFF, flag;
+  for (uint16_t i = 0; i < u16length; i++) {
+    temp = temp ^ pu8data[i];
+    for (unsigned char j = 1; j <= 8; j++) {
+      flag = temp & 0x0001;
+      temp >>=1;
+      if (flag)
+        temp ^= 0xA001;
+    }
+  }
+  return temp;
+}
+
+static double seconds() {
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint64_t cycles() {
+#if BENCH_CYCLES
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+/**
+ * Runs crc over the buffer in frames of u16frame bytes, u32rounds times.
+ * Prints the throughput and returns a checksum of the results.
+ */
+template <typename F>
+static uint32_t measure( const char *pcName, F crc, const uint8_t *pu8data, uint32_t u32size,
+  uint16_t u16frame, uint32_t u32rounds ) {
+  uint32_t u32sum = 0;
+  double dStart = seconds();
+  uint64_t u64start = cycles();
+
+  for (uint32_t r = 0; r < u32rounds; r++) {
+    for (uint32_t i = 0; i + u16frame <= u32size; i += u16frame) {
+      u32sum += crc( pu8data + i, u16frame );
+    }
+  }
+
+  uint64_t u64cycles = cycles() - u64start;
+  double dTime = seconds() - dStart;
+  double dBytes = (double) (u32size / u16frame) * u16frame * u32rounds;
+  printf( "%-9s frame %3u: %8.3f GB/s", pcName, u16frame, dBytes / dTime * 1e-9 );
+  if (BENCH_CYCLES) printf( "  %6.3f bytes/cycle", dBytes / u64cycles );
+  printf( "\n" );
+  return u32sum;
+}
+
+int main( int argc, char **argv ) {
+  uint32_t u32megabytes = (argc > 1) ? atoi( argv[1] ) : 4;
+  const uint32_t u32size = 1 << 16;
+  static const uint16_t au16frames[] = { 8, 64, 256 };
+  uint8_t *pu8data = (uint8_t *) malloc( u32size );
+  int failures = 0;
+
+  srand( 1 );
+  for (uint32_t i = 0; i < u32size; i++) pu8data[i] = rand();
+
+  // the engine must match the bit loop on every length and alignment
+  for (uint32_t i = 0; i < 20000; i++) {
+    uint16_t u16offset = rand() % 256, u16length = rand() % 300;
+    if (crc16Block( 0xFFFF, pu8data + u16offset, u16length ) != crcReference( pu8data + u16offset, u16length )) {
+      failures++;
+    }
+  }
+  if (failures > 0) {
+    printf( "%s: %d CRC mismatches\n", engineName(), failures );
+    return 1;
+  }
+
+  for (uint8_t f = 0; f < sizeof( au16frames ) / sizeof( au16frames[0] ); f++) {
+    uint32_t u32rounds = u32megabytes * 16;
+    uint32_t u32a = measure( "reference", crcReference, pu8data, u32size, au16frames[f], u32rounds / 8 + 1 );
+    uint32_t u32b = measure( engineName(), [](const uint8_t *p, uint16_t n) { return crc16Block( 0xFFFF, p, n ); },
+      pu8data, u32size, au16frames[f], u32rounds );
+    // keep the results alive
+    if (u32a == 1 && u32b == 1) printf( "\n" );
+  }
+  free( pu8data );
+  return 0;
+}
@@ -0,0 +1,99 @@
+/**
+ * @file 		bench_swap.cpp
+ *
+ * @description
+ *  Host benchmark of encodeRegisters() and decodeRegisters(), the byte
+ *  swap of FC3/FC4 answers and FC16 requests, against the scalar
+ *  highByte()/lowByte() loop. Every length up to 300 registers, odd ones
+ *  included, is first checked at aligned and unaligned frame offsets.
+ *
+ *  Usage: bench_swap [rounds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "ModbusRtu.h"
+
+#define REGS_MAX  300
+
+// the former register loops, one byte at a time
+static void encodeReference( uint8_t *pu8dst, const uint16_t *pu16src, uint16_t u16count ) {
+  for (uint16_t i = 0; i < u16count; i++) {
+    pu8dst[ 2 * i ] = highByte( pu16src[ i ] );
+    pu8dst[ 2 * i + 1 ] = lowByte( pu16src[ i ] );
+  }
+}
+
+static void decodeReference( uint16_t *pu16dst, const uint8_t *pu8src, uint16_t u16count ) {
+  for (uint16_t i = 0; i < u16count; i++) {
+    pu16dst[ i ] = word( pu8src[ 2 * i ], pu8src[ 2 * i + 1 ] );
+  }
+}
+
+static double seconds() {
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main( int argc, char **argv ) {
+  uint32_t u32rounds = (argc > 1) ? atoi( argv[1] ) : 200000;
+  static uint16_t au16regs[ REGS_MAX + 1 ], au16out[ REGS_MAX + 1 ], au16ref[ REGS_MAX + 1 ];
+  static uint8_t au8frame[ 2 * REGS_MAX + 8 ], au8ref[ 2 * REGS_MAX + 8 ];
+  static const uint16_t au16counts[] = { 3, 16, 61, 125 };
+  uint32_t u32sum = 0;
+  int failures = 0;
+
+  srand( 1 );
+  for (uint16_t i = 0; i <= REGS_MAX; i++) au16regs[i] = rand();
+
+  // every length at 3 offsets in the frame, the guard bytes must not change
+  for (uint16_t u16count = 0; u16count <= REGS_MAX; u16count++) {
+    for (uint8_t u8offset = 0; u8offset < 3; u8offset++) {
+      memset( au8frame, 0x5a, sizeof( au8frame ) );
+      memset( au8ref, 0x5a, sizeof( au8ref ) );
+      encodeRegisters( au8frame + u8offset, au16regs, u16count );
+      encodeReference( au8ref + u8offset, au16regs, u16count );
+      if (memcmp( au8frame, au8ref, sizeof( au8frame ) ) != 0) {
+        printf( "encodeRegisters: %u registers at offset %u differ\n", u16count, u8offset );
+        failures++;
+      }
+      memset( au16out, 0x5a, sizeof( au16out ) );
+      memset( au16ref, 0x5a, sizeof( au16ref ) );
+      decodeRegisters( au16out, au8ref + u8offset, u16count );
+      decodeReference( au16ref, au8ref + u8offset, u16count );
+      if (memcmp( au16out, au16ref, sizeof( au16out ) ) != 0) {
+        printf( "decodeRegisters: %u registers at offset %u differ\n", u16count, u8offset );
+        failures++;
+      }
+    }
+  }
+  if (failures > 0) return 1;
+
+  printf( "%s swap, ns per call\n", MODBUS_SIMD_SWAP ? "SIMD" : "scalar" );
+  printf( "registers   encode   scalar   decode   scalar\n" );
+  for (uint8_t c = 0; c < sizeof( au16counts ) / sizeof( au16counts[0] ); c++) {
+    uint16_t u16count = au16counts[c];
+    double adTime[4];
+
+    for (uint8_t k = 0; k < 4; k++) {
+      double dStart = seconds();
+      for (uint32_t r = 0; r < u32rounds; r++) {
+        switch( k ) {
+        case 0: encodeRegisters( au8frame + 1, au16regs, u16count ); break;
+        case 1: encodeReference( au8frame + 1, au16regs, u16count ); break;
+        case 2: decodeRegisters( au16out, au8frame + 1, u16count ); break;
+        case 3: decodeReference( au16out, au8frame + 1, u16count ); break;
+        }
+        // keep the calls from being merged across rounds
+        u32sum += au8frame[ 1 + (r % (2 * u16count)) ] + au16out[ r % u16count ];
+        au16regs[ r % u16count ]++;
+      }
+      adTime[k] = (seconds() - dStart) * 1e9 / u32rounds;
+    }
+    printf( "%9u %8.1f %8.1f %8.1f %8.1f\n", u16count, adTime[0], adTime[1], adTime[2], adTime[3] );
+  }
+  return (u32sum == 0) ? 2 : 0;
+}
@@ -0,0 +1,46 @@
+/**
+ * @file 		posix_port.cpp
+ *
+ * @description
+ *  Host test of ModbusPort, the POSIX backend of ModbusHal.h, on a pty.
+ *  A query must return once the other end hung up, as with an unplugged
+ *  USB adapter, and a rate that termios does not know leaves the port
+ *  closed instead of running at another speed than T1.5/T3.5.
+ *
+ *  Usage: posix_port
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "ModbusRtu.h"
+
+int main() {
+  int failures = 0;
+  int i16master = posix_openpt( O_RDWR | O_NOCTTY );
+  if ((i16master < 0) || (grantpt( i16master ) < 0) || (unlockpt( i16master ) < 0)) {
+    printf( "no pty, skipped\n" );
+    return 0;
+  }
+  halSetDevice( 0, ptsname( i16master ) );
+
+  static Modbus master( 0, 0, 0 );
+  master.begin( 19200 );
+  if (halPort( 0 )->getFd() < 0) {
+    printf( "pty not opened\n" );
+    failures++;
+  }
+
+  // EIO on every write, ctest times out if write() keeps retrying
+  close( i16master );
+  uint16_t au16regs[ 2 ];
+  modbus_t telegram = { 1, MB_FC_READ_REGISTERS, 0, 2, au16regs };
+  master.query( telegram );
+
+  master.begin( 12345 );
+  if (halPort( 0 )->getFd() >= 0) {
+    printf( "port opened at an unsupported rate\n" );
+    failures++;
+  }
+  printf( "%s\n", (failures == 0) ? "posix port OK" : "posix port FAILED" );
+  return (failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,153 @@
+/**
+ * @file 		rx_stream.cpp
+ *
+ * @description
+ *  Host test bench of the receive state machine. A slave is fed
+ *  randomized byte streams back to back through feedByte(), with
+ *  onSilence() standing for the T3.5 gap between frames: valid requests,
+ *  corrupted ones, random noise, frames longer than MAX_BUFFER and
+ *  writes cut short by the silence. Only the valid requests may change
+ *  the registers, the cut ones get an exception. Functions left out of
+ *  MODBUS_FUNCTIONS must get EXC_FUNC_CODE instead of an answer.
+ *  Build with -fsanitize=address to also catch writes past au8Buffer.
+ *
+ *  Usage: rx_stream [frames] [seed]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <vector>
+#include "ModbusRtu.h"
+
+#define SLAVE_ID  1
+#define REGS_NO   16
+
+static std::vector<uint8_t> frame( std::vector<uint8_t> au8data ) {
+  uint16_t u16crc = crc16Block( 0xFFFF, au8data.data(), au8data.size() );
+  au8data.push_back( lowByte( u16crc ) );
+  au8data.push_back( highByte( u16crc ) );
+  return au8data;
+}
+
+static double seconds() {
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main( int argc, char **argv ) {
+  uint32_t u32frames = (argc > 1) ? atoi( argv[1] ) : 100000;
+  srand( (argc > 2) ? atoi( argv[2] ) : 1 );
+
+  static Modbus slave( SLAVE_ID, 0, 0 );
+  static uint16_t au16regs[ REGS_NO ], au16shadow[ REGS_NO ];
+  uint32_t u32answers = 0, u32overflows = 0, u32bytes = 0;
+  int failures = 0;
+
+  slave.begin( 115200 );
+  slave.setHoldingRegisters( au16regs, REGS_NO );
+
+  double dStart = seconds();
+  for (uint32_t n = 0; n < u32frames; n++) {
+    std::vector<uint8_t> au8stream;
+    uint8_t u8case = rand() % 7;
+    uint16_t u16add = rand() % REGS_NO;
+    uint16_t u16no = 1 + rand() % (REGS_NO - u16add);
+    boolean bValid = false;
+
+    switch( u8case ) {
+    case 0: // write one register
+      au8stream = frame( { SLAVE_ID, MB_FC_WRITE_REGISTER, 0, (uint8_t) u16add, (uint8_t) rand(), (uint8_t) rand() } );
+      bValid = true;
+      break;
+    case 1: // read registers
+      au8stream = frame( { SLAVE_ID, MB_FC_READ_REGISTERS, 0, (uint8_t) u16add, 0, (uint8_t) u16no } );
+      bValid = true;
+      break;
+    case 2: // write registers, or a corrupted write
+    case 3:
+      // the whole request must fit in au8Buffer
+      if (9 + 2 * u16no > MAX_BUFFER) u16no = (MAX_BUFFER - 9) / 2;
+      if (u16no == 0) continue;
+      au8stream = { SLAVE_ID, MB_FC_WRITE_MULTIPLE_REGISTERS, 0, (uint8_t) u16add, 0, (uint8_t) u16no, (uint8_t)(u16no * 2) };
+      for (uint16_t i = 0; i < u16no * 2; i++) au8stream.push_back( rand() );
+      au8stream = frame( au8stream );
+      if (u8case == 3) au8stream[ 1 + rand() % (au8stream.size() - 1) ] ^= 1 << (rand() % 8);
+      bValid = (u8case == 2);
+      break;
+    case 4: // noise, for another slave
+      au8stream.push_back( SLAVE_ID + 1 + rand() % 200 );
+      for (uint16_t i = rand() % (3 * MAX_BUFFER); i > 0; i--) au8stream.push_back( rand() );
+      break;
+    case 5: // a write that does not fit in MAX_BUFFER
+      if (MAX_BUFFER > 9 + 2 * 120) continue;
+      au8stream = { SLAVE_ID, MB_FC_WRITE_MULTIPLE_REGISTERS, 0, 0, 0, 120, 240 };
+      for (uint16_t i = 0; i < 240; i++) au8stream.push_back( rand() );
+      au8stream = frame( au8stream );
+      u32overflows++;
+      break;
+    case 6: // a write with a good CRC but fewer bytes than its counter
+      if (9 + 2 * u16no > MAX_BUFFER) u16no = (MAX_BUFFER - 9) / 2;
+      if (u16no == 0) continue;
+      au8stream = { SLAVE_ID, MB_FC_WRITE_MULTIPLE_REGISTERS, 0, (uint8_t) u16add, 0, (uint8_t) u16no, (uint8_t)(u16no * 2) };
+      for (uint16_t i = rand() % (u16no * 2); i > 0; i--) au8stream.push_back( rand() );
+      au8stream = frame( au8stream );
+      break;
+    }
+
+    // the stream at full rate, then the gap before the next frame
+    uint16_t u16out = slave.getOutCnt();
+    int16_t i16state = 0;
+    for (uint16_t i = 0; i < au8stream.size(); i++) {
+      int16_t i16result = slave.feedByte( au8stream[i] );
+      if (i16result != 0) i16state = i16result;
+    }
+    int16_t i16silence = slave.onSilence();
+    if (i16silence != 0) i16state = i16silence;
+    u32bytes += au8stream.size();
+
+    // a function left out of MODBUS_FUNCTIONS is answered with an exception
+    uint8_t u8exception = 0;
+    if ((bValid || (u8case == 6)) && !fctSupported( au8stream[ FUNC ] )) u8exception = EXC_FUNC_CODE;
+    else if (u8case == 6) u8exception = EXC_REGS_QUANT;
+
+    if (u8exception != 0) {
+      if ((i16state != u8exception) || (slave.getOutCnt() != (uint16_t)(u16out + 1))) {
+        printf( "frame %u (case %u): exception %u expected, state %d\n", n, u8case, u8exception, i16state );
+        failures++;
+      }
+    }
+    else if (bValid) {
+      if ((i16state <= 4) || (slave.getOutCnt() != (uint16_t)(u16out + 1))) {
+        printf( "frame %u (case %u): not answered, state %d\n", n, u8case, i16state );
+        failures++;
+      }
+      u32answers++;
+      if (u8case == 0) au16shadow[ u16add ] = word( au8stream[4], au8stream[5] );
+      if (u8case == 2) {
+        for (uint16_t i = 0; i < u16no; i++) au16shadow[ u16add + i ] = word( au8stream[7 + 2 * i], au8stream[8 + 2 * i] );
+      }
+    }
+    else if (slave.getOutCnt() != u16out) {
+      printf( "frame %u (case %u): answered a bad frame\n", n, u8case );
+      failures++;
+    }
+    if ((u8case == 5) && (i16state != ERR_BUFF_OVERFLOW)) {
+      printf( "frame %u: oversized frame not reported, state %d\n", n, i16state );
+      failures++;
+    }
+    if (failures > 10) break;
+  }
+  double dTime = seconds() - dStart;
+
+  for (uint16_t i = 0; i < REGS_NO; i++) {
+    if (au16regs[i] != au16shadow[i]) {
+      printf( "register %u: %04x, %04x expected\n", i, au16regs[i], au16shadow[i] );
+      failures++;
+    }
+  }
+  printf( "%u frames, %u answered, %u oversized, %u bytes in %.1f ms (%.1f MB/s)\n",
+    u32frames, u32answers, u32overflows, u32bytes, dTime * 1e3, u32bytes / dTime * 1e-6 );
+  return (failures == 0) ? 0 : 1;
+}